@@ -1,7 +1,4 @@
 
-#define SCROLL_REDRAW
-#undef SCROLL_SHIFT
-
 /*
  *  Copyright 2000-2001 by Geert Uytterhoeven <geert@linux-m68k.org>
  *
@@ -18,9 +15,68 @@
 #include <linux/module.h>
 #include <linux/sched.h>
 #include <linux/console.h>
+#include <linux/tqueue.h>
+
+#include <asm/div64.h>
+#include <asm/system.h>
+#include <asm/timex.h>
+
+    /*
+     *  printk() strips the "<N>" loglevel before calling console drivers, and
+     *  has already dropped the messages above console_loglevel ("dmesg -n"),
+     *  so kernel messages can only be switched off completely
+     */
 
 static int lcd_console_messages = 1;
 
+MODULE_PARM(lcd_console_messages, "i");
+
+#define lcd_mb()		mb()
+
+#ifndef ndelay
+#define ndelay(n)		udelay(((n)+999)/1000)
+#endif
+
+    /*
+     *  Deadlines use the cycle counter, as the time of day steps when it's
+     *  set. It's calibrated against udelay() in lcd_init(). Without a cycle
+     *  counter, the time stands still, so every wait takes the full execution
+     *  time.
+     */
+
+static unsigned long lcd_cycles_per_us = 0;
+
+static inline unsigned long lcd_now_us(void)
+{
+    unsigned long long cycles;
+
+    if (!lcd_cycles_per_us)
+	return 0;
+    cycles = get_cycles();
+    do_div(cycles, lcd_cycles_per_us);
+    return cycles;
+}
+
+    /*
+     *  lcd_now_us() rounds down, so deadlines are rounded up, to never expire
+     *  before the execution time has passed
+     */
+
+static inline unsigned long lcd_deadline_us(unsigned int usecs)
+{
+    return lcd_now_us()+1+usecs;
+}
+
+#define lcd_clock_sync(lcd)	do { } while (0)
+
+static void lcd_calibrate_cycles(void)
+{
+    cycles_t start = get_cycles();
+
+    udelay(1000);
+    lcd_cycles_per_us = (unsigned long)(get_cycles()-start)/1000;
+}
+
 #else /* !__KERNEL__ */
 
 #include <stdio.h>
@@ -32,161 +88,1132 @@ static int lcd_console_messages = 1;
 #define MOD_INC_USE_COUNT	do { } while (0)
 #define MOD_DEC_USE_COUNT	do { } while (0)
 
-typedef unsigned char u8;
+#define lcd_mb()		__sync_synchronize()
+
+typedef unsigned char u8;
+
+
+#endif /* !__KERNEL__ */
+
+#include "hd44780.h"
+
+#ifndef __KERNEL__
+    /*
+     *  Delay Engine
+     *
+     *  Real delays spin until a deadline on CLOCK_MONOTONIC_RAW, or on the TSC
+     *  if it has been calibrated using lcd_use_tsc(). Unlike a calibrated
+     *  delay loop, both are immune to CPU frequency scaling, and need no
+     *  startup calibration.
+     */
+
+static unsigned long long lcd_real_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return ts.tv_sec*1000000000ULL+ts.tv_nsec;
+}
+
+static unsigned long lcd_tsc_khz = 0;	/* 0 if the TSC is not used */
+
+#if defined(__i386__) || defined(__x86_64__)
+
+#include <cpuid.h>
+
+#define LCD_TSC_CALIBRATE_NS	20000000
+
+static inline unsigned long long lcd_rdtsc(void)
+{
+    unsigned int lo, hi;
+
+    __asm__ __volatile__("rdtsc" : "=a" (lo), "=d" (hi));
+    return ((unsigned long long)hi << 32) | lo;
+}
+
+static inline void cpu_relax(void)
+{
+    __asm__ __volatile__("pause" : : : "memory");
+}
+
+static unsigned long lcd_calibrate_tsc(void)
+{
+    unsigned long long t0, t1, c0, c1;
+
+    t0 = lcd_real_now_ns();
+    c0 = lcd_rdtsc();
+    do
+	t1 = lcd_real_now_ns();
+    while (t1-t0 < LCD_TSC_CALIBRATE_NS);
+    c1 = lcd_rdtsc();
+    return (c1-c0)*1000000/(t1-t0);
+}
+
+    /*
+     *  Use the TSC for delays, if it runs at a constant rate. The calibration
+     *  is read from file, or stored there if the file doesn't exist yet
+     */
+
+int lcd_use_tsc(const char *file)
+{
+    unsigned int eax, ebx, ecx, edx;
+    unsigned long khz = 0;
+    FILE *f;
+
+    if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) ||
+	!(edx & (1 << 8)))
+	return -1;		/* No invariant TSC */
+
+    if (file && (f = fopen(file, "r"))) {
+	if (fscanf(f, "%lu", &khz) != 1)
+	    khz = 0;
+	fclose(f);
+    }
+    if (!khz) {
+	khz = lcd_calibrate_tsc();
+	if (file && (f = fopen(file, "w"))) {
+	    fprintf(f, "%lu\n", khz);
+	    fclose(f);
+	}
+    }
+    lcd_tsc_khz = khz;
+    return 0;
+}
+
+#else /* !__i386__ && !__x86_64__ */
+
+#define lcd_rdtsc()	0ULL
+#define cpu_relax()	do { } while (0)
+
+int lcd_use_tsc(const char *file)
+{
+    return -1;
+}
+
+#endif /* !__i386__ && !__x86_64__ */
+
+    /*
+     *  Long delays sleep for all but the last lcd_spin_ns, to not burn a full
+     *  core during e.g. a clear. The final stretch is spun for accuracy.
+     */
+
+#define LCD_SPIN_THRESHOLD_US	100
+
+static unsigned long long lcd_spin_ns = LCD_SPIN_THRESHOLD_US*1000ULL;
+
+unsigned long lcd_set_spin_threshold(unsigned long usecs)
+{
+    unsigned long old = lcd_spin_ns/1000;
+
+    lcd_spin_ns = usecs*1000ULL;
+    return old;
+}
+
+    /*
+     *  Time spent asleep, per thread so each display's statistics only count
+     *  its own delays
+     */
+
+static __thread unsigned long long lcd_slept_ns = 0;
+
+static void lcd_sleep_until(unsigned long long end)
+{
+    unsigned long long now = lcd_real_now_ns();
+    struct timespec ts;
+
+    if (end <= now+lcd_spin_ns)
+	return;
+    /* clock_nanosleep() doesn't support CLOCK_MONOTONIC_RAW */
+    ts.tv_sec = (end-now-lcd_spin_ns)/1000000000;
+    ts.tv_nsec = (end-now-lcd_spin_ns)%1000000000;
+    clock_nanosleep(CLOCK_MONOTONIC, 0, &ts, NULL);
+    lcd_slept_ns += lcd_real_now_ns()-now;
+}
+
+static void lcd_real_delay_ns(unsigned long long nsecs)
+{
+    unsigned long long end;
+
+    if (lcd_tsc_khz) {
+	end = lcd_rdtsc()+nsecs*lcd_tsc_khz/1000000;
+	if (nsecs > lcd_spin_ns)
+	    lcd_sleep_until(lcd_real_now_ns()+nsecs);
+	while (lcd_rdtsc() < end)
+	    cpu_relax();
+    } else {
+	end = lcd_real_now_ns()+nsecs;
+	if (nsecs > lcd_spin_ns)
+	    lcd_sleep_until(end);
+	while (lcd_real_now_ns() < end)
+	    cpu_relax();
+    }
+}
+
+const struct lcd_clock lcd_clock_real = {
+    name:	"real",
+    now_ns:	lcd_real_now_ns,
+    delay_ns:	lcd_real_delay_ns
+};
+
+    /*
+     *  Virtual time only advances when delaying, so a run takes no longer
+     *  than the CPU time it needs, while the clock shows how long it would
+     *  have taken on the real thing. It starts at the real time, so pending
+     *  deadlines carry over when switching. Each thread has its own virtual
+     *  time, as displays driven from different threads don't wait for each
+     *  other.
+     */
+
+static __thread unsigned long long lcd_virtual_ns = 0;
+
+static unsigned long long lcd_virtual_now_ns(void)
+{
+    if (!lcd_virtual_ns)
+	lcd_virtual_ns = lcd_real_now_ns();
+    return lcd_virtual_ns;
+}
+
+static void lcd_virtual_delay_ns(unsigned long long nsecs)
+{
+    lcd_virtual_ns = lcd_virtual_now_ns()+nsecs;
+}
+
+const struct lcd_clock lcd_clock_virtual = {
+    name:	"virtual",
+    now_ns:	lcd_virtual_now_ns,
+    delay_ns:	lcd_virtual_delay_ns
+};
+
+static const struct lcd_clock *lcd_clock = &lcd_clock_real;
+
+const struct lcd_clock *lcd_set_clock(const struct lcd_clock *clock)
+{
+    const struct lcd_clock *old = lcd_clock;
+
+    lcd_clock = clock;
+    return old;
+}
+
+const struct lcd_clock *lcd_get_clock(void)
+{
+    return lcd_clock;
+}
+
+unsigned long long lcd_clock_ns(void)
+{
+    return lcd_clock->now_ns();
+}
+
+static unsigned long lcd_now_us(void)
+{
+    return lcd_clock_ns()/1000;
+}
+
+static unsigned long lcd_deadline_us(unsigned int usecs)
+{
+    return (lcd_clock_ns()+999)/1000+usecs;
+}
+
+    /*
+     *  A display may move to another thread, whose virtual time is behind.
+     *  Its deadlines and the software LCD's state are based on the time it
+     *  was last used, so before touching it, the thread's clock is advanced
+     *  to that time. Time never runs backwards for a display.
+     */
+
+static void lcd_clock_sync(struct lcd_device *lcd)
+{
+    unsigned long long now;
+
+    if (lcd_clock != &lcd_clock_virtual)
+	return;
+    now = lcd_virtual_now_ns();
+    if (now < lcd->clock_ns)
+	lcd_virtual_ns = lcd->clock_ns;
+    else
+	lcd->clock_ns = now;
+}
+
+static void ndelay(unsigned long long nsecs)
+{
+    lcd_clock->delay_ns(nsecs);
+}
+
+void lcd_udelay(unsigned long usecs)
+{
+    ndelay(usecs*1000ULL);
+}
+
+static unsigned long long lcd_cpu_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec*1000000000ULL+ts.tv_nsec;
+}
+
+#endif /* !__KERNEL__ */
+
+
+    /*
+     *  DDRAM addresses, using the tables built by lcd_set_geometry()
+     */
+
+#define LCD_LINE_LEN	0x28
+#define LCD_LINE2	0x40
+
+static inline int lcd_valid_addr(struct lcd_device *lcd, int addr)
+{
+    return addr >= 0 && lcd->addr_pos[addr] != LCD_POS_NONE;
+}
+
+static inline int lcd_next_addr(struct lcd_device *lcd, int addr)
+{
+    return lcd->addr_next[addr];
+}
+
+static inline int lcd_prev_addr(struct lcd_device *lcd, int addr)
+{
+    return lcd->addr_prev[addr];
+}
+
+    /*
+     *  Number of address counter steps from one valid address to another
+     */
+
+static inline int lcd_addr_dist(struct lcd_device *lcd, int from, int to)
+{
+    int dist = lcd->addr_pos[to]-lcd->addr_pos[from];
+
+    return dist < 0 ? dist+LCD_DDRAM_CELLS : dist;
+}
+
+
+#define LCD_DELAY_STROBE_NS	500
+#define LCD_DELAY_WRITE_US	50
+#define LCD_DELAY_READ_US	41
+#define LCD_DELAY_CLR		1520
+
+static void lcd_seq_delay(struct lcd_device *lcd, unsigned long nsecs);
+
+    /*
+     *  Delays are accounted to the display, or recorded instead of waited for
+     *  while compiling a sequence
+     */
+
+static void lcd_delay(struct lcd_device *lcd, unsigned long nsecs)
+{
+#ifdef __KERNEL__
+    ndelay(nsecs);
+#else
+    unsigned long long slept = lcd_slept_ns;
+
+    ndelay(nsecs);
+    lcd->stats.sleep_ns += lcd_slept_ns-slept;
+#endif
+    lcd->stats.delay_ns += nsecs;
+}
+
+void lcd_ndelay(struct lcd_device *lcd, unsigned long nsecs)
+{
+    if (lcd->seq_recording)
+	lcd_seq_delay(lcd, nsecs);
+    else
+	lcd_delay(lcd, nsecs);
+}
+
+void lcd_delay_strobe(struct lcd_device *lcd)
+{
+    lcd_ndelay(lcd, LCD_DELAY_STROBE_NS);
+}
+
+    /*
+     *  Mid-Level LCD Access
+     */
+
+#ifdef LCD_STATIC_PARLCD
+
+    /*
+     *  The driver is bound at compile time (see parlcd.h), so the compiler
+     *  resolves all calls through lcd_driver(), and inlines them
+     */
+
+#include "parlcd.h"
+
+static const struct lcd_driver parlcd_driver;
+
+static inline const struct lcd_driver *lcd_driver(struct lcd_device *lcd)
+{
+    return &parlcd_driver;
+}
+
+int lcd_bus_width(struct lcd_device *lcd)
+{
+#if PARLCD_WIDTH == 8
+    return 8;
+#else
+    return lcd->width;
+#endif
+}
+
+#else /* !LCD_STATIC_PARLCD */
+
+static inline const struct lcd_driver *lcd_driver(struct lcd_device *lcd)
+{
+    return lcd->driver;
+}
+
+int lcd_bus_width(struct lcd_device *lcd)
+{
+    return lcd->width;
+}
+
+#endif /* !LCD_STATIC_PARLCD */
+
+    /*
+     *  The display must be zeroed before its driver is registered for the
+     *  first time, or before lcd_set_geometry() if that comes first. priv is
+     *  the driver's instance data.
+     */
+
+void lcd_register_driver(struct lcd_device *lcd,
+			 const struct lcd_driver *driver, void *priv)
+{
+    int i;
+
+    if (!lcd->width) {
+	lcd->width = 8;		/* The HD44780 boots up in 8-bit mode */
+	for (i = 0; i < LCD_CHIPS_MAX; i++)
+	    lcd->chips[i].ac_inc = 1;
+	lcd->log_level = 8;
+	lcd->log_bol = 1;
+	if (!lcd->cols)
+	    lcd_set_geometry(lcd, LCD_DEFAULT_COLS, LCD_DEFAULT_ROWS);
+	lcd_invalidate(lcd);
+    }
+    lcd->driver = driver;
+    lcd->priv = priv;
+}
+
+void lcd_unregister_driver(struct lcd_device *lcd,
+			   const struct lcd_driver *driver)
+{
+    lcd->driver = NULL;
+}
+
+static void lcd_xfer_write(struct lcd_device *lcd, u8 val, int rs)
+{
+    if (lcd_driver(lcd)->write) {
+	lcd_driver(lcd)->write(lcd, val, rs);
+	return;
+    }
+    lcd_driver(lcd)->set_rs_rw(lcd, rs, 0);
+    if (lcd->width == 4) {
+	/* Write High Nibble */
+	lcd_driver(lcd)->set_data(lcd, val);
+	lcd_driver(lcd)->set_e(lcd, 1);
+	lcd_delay_strobe(lcd);
+	lcd_driver(lcd)->set_e(lcd, 0);
+	lcd_delay_strobe(lcd);
+	/* Write Low Nibble */
+	val <<= 4;
+    }
+    lcd_driver(lcd)->set_data(lcd, val);
+    lcd_driver(lcd)->set_e(lcd, 1);
+    lcd_delay_strobe(lcd);
+    lcd_driver(lcd)->set_e(lcd, 0);
+}
+
+static u8 lcd_xfer_read(struct lcd_device *lcd, int rs)
+{
+    u8 val;
+
+    if (lcd_driver(lcd)->read)
+	return lcd_driver(lcd)->read(lcd, rs);
+    lcd_driver(lcd)->set_rs_rw(lcd, rs, 1);
+    /* Read Byte or High Nibble */
+    lcd_driver(lcd)->set_e(lcd, 1);
+    lcd_delay_strobe(lcd);
+    val = lcd_driver(lcd)->get_data(lcd);
+    lcd_driver(lcd)->set_e(lcd, 0);
+    if (lcd->width == 4) {
+	val &= 0xf0;
+	lcd_delay_strobe(lcd);
+	/* Read Low Nibble */
+	lcd_driver(lcd)->set_e(lcd, 1);
+	lcd_delay_strobe(lcd);
+	val |= lcd_driver(lcd)->get_data(lcd) >> 4;
+	lcd_driver(lcd)->set_e(lcd, 0);
+    }
+    return val;
+}
+
+
+    /*
+     *  Controller State Tracking
+     *
+     *  We follow all transfers to know the contents of the controller's
+     *  registers, so commands that would not change them can be skipped.
+     */
+
+static void lcd_invalidate_chip(struct lcd_chip *chip)
+{
+    chip->ac = -1;
+    chip->reg_mode = chip->reg_ctrl = chip->reg_func = -1;
+}
+
+void lcd_invalidate(struct lcd_device *lcd)
+{
+    int i;
+
+    for (i = 0; i < LCD_CHIPS_MAX; i++)
+	lcd_invalidate_chip(&lcd->chips[i]);
+}
+
+    /*
+     *  Select the controller that gets the next transfers. A compiled
+     *  sequence can only drive the one it was started for.
+     */
+
+static inline int lcd_chip_num(struct lcd_device *lcd)
+{
+    return lcd->chip-lcd->chips;
+}
+
+void lcd_select(struct lcd_device *lcd, int chip)
+{
+    if (lcd->seq_recording && chip != lcd->seq_recording->chip) {
+	lcd->seq_recording->overflow = 1;
+	return;
+    }
+    lcd->chip = &lcd->chips[chip];
+    lcd->e_mask = 1 << chip;
+}
+
+    /*
+     *  Broadcast: select all controllers, so a transfer strobes all their E
+     *  lines at once. State is tracked for each of them, reads come from the
+     *  first one.
+     */
+
+void lcd_select_all(struct lcd_device *lcd)
+{
+    if (lcd->seq_recording && lcd->nchips > 1) {
+	lcd->seq_recording->overflow = 1;
+	return;
+    }
+    lcd->chip = &lcd->chips[0];
+    lcd->e_mask = (1 << lcd->nchips)-1;
+}
+
+static inline int lcd_broadcasting(struct lcd_device *lcd)
+{
+    return lcd->e_mask & (lcd->e_mask-1);
+}
+
+static inline int lcd_chip_ac(const struct lcd_chip *chip)
+{
+    return chip->ac_cgram ? -1 : chip->ac;
+}
+
+static void lcd_ac_step(struct lcd_device *lcd, int inc)
+{
+    if (lcd->chip->ac < 0)
+	return;
+    if (lcd->chip->ac_cgram)
+	lcd->chip->ac = (lcd->chip->ac + (inc ? 1 : -1)) & LCD_CGRAM_MASK;
+    else if (!lcd_valid_addr(lcd, lcd->chip->ac))
+	lcd->chip->ac = -1;
+    else
+	lcd->chip->ac = inc ? lcd_next_addr(lcd, lcd->chip->ac)
+		      : lcd_prev_addr(lcd, lcd->chip->ac);
+}
+
+static void lcd_track(struct lcd_device *lcd, u8 val, int rs)
+{
+    if (rs)
+	lcd_ac_step(lcd, lcd->chip->ac_inc);
+    else if (val & LCD_CMD_DDRAM) {
+	lcd->chip->ac = val & LCD_DDRAM_MASK;
+	lcd->chip->ac_cgram = 0;
+    } else if (val & LCD_CMD_CGRAM) {
+	lcd->chip->ac = val & LCD_CGRAM_MASK;
+	lcd->chip->ac_cgram = 1;
+    } else if (val & LCD_CMD_FUNC)
+	lcd->chip->reg_func = val;
+    else if (val & LCD_CMD_SHIFT) {
+	if (!(val & LCD_SHIFT_DISP))
+	    lcd_ac_step(lcd, val & LCD_SHIFT_RIGHT);
+    } else if (val & LCD_CMD_CTRL)
+	lcd->chip->reg_ctrl = val;
+    else if (val & LCD_CMD_MODE) {
+	lcd->chip->reg_mode = val;
+	lcd->chip->ac_inc = val & LCD_INC;
+    } else if (val & LCD_CMD_HOME) {
+	lcd->chip->ac = 0;
+	lcd->chip->ac_cgram = 0;
+    } else if (val & LCD_CMD_CLR) {
+	lcd->chip->ac = 0;
+	lcd->chip->ac_cgram = 0;
+	lcd->chip->ac_inc = 1;
+	if (lcd->chip->reg_mode >= 0)
+	    lcd->chip->reg_mode |= LCD_INC;
+    }
+}
+
+    /*
+     *  reg is the selected controller's copy, when broadcasting the others
+     *  may differ
+     */
+
+static void lcd_write_reg(struct lcd_device *lcd, int reg, u8 cmd)
+{
+    if (reg == cmd && !lcd_broadcasting(lcd)) {
+	lcd->stats.elided++;
+	return;
+    }
+    lcd_write_cmd(lcd, cmd);
+}
+
+void lcd_mode(struct lcd_device *lcd, int inc, int shift)
+{
+    lcd_write_reg(lcd, lcd->chip->reg_mode, LCD_CMD_MODE | inc | shift);
+}
+
+    /*
+     *  Applies to all controllers, but only the selected one shows the cursor.
+     *  If they all need the same command, it's broadcast.
+     */
+
+static inline u8 lcd_ctrl_cmd(struct lcd_device *lcd, int chip)
+{
+    if (chip != lcd_chip_num(lcd))
+	return lcd->ctrl & ~(LCD_CURSOR_ON | LCD_BLINK_ON);
+    return lcd->ctrl;
+}
+
+    /*
+     *  Whether a controller's display control register is not what
+     *  lcd_write_ctrl() would write, e.g. because another one got selected
+     */
+
+static int lcd_ctrl_stale(struct lcd_device *lcd)
+{
+    int i;
+
+    for (i = 0; i < lcd->nchips; i++)
+	if (lcd->chips[i].reg_ctrl != lcd_ctrl_cmd(lcd, i))
+	    return 1;
+    return 0;
+}
+
+static void lcd_write_ctrl(struct lcd_device *lcd)
+{
+    int sel = lcd_chip_num(lcd), i, same = 1;
+    u8 cmd[LCD_CHIPS_MAX];
+
+    for (i = 0; i < lcd->nchips; i++) {
+	cmd[i] = lcd_ctrl_cmd(lcd, i);
+	if (cmd[i] != cmd[0] || lcd->chips[i].reg_ctrl == cmd[i])
+	    same = 0;
+    }
+    if (same && lcd->nchips > 1) {
+	lcd_select_all(lcd);
+	lcd_write_cmd(lcd, cmd[0]);
+    } else
+	for (i = 0; i < lcd->nchips; i++) {
+	    lcd_select(lcd, i);
+	    lcd_write_reg(lcd, lcd->chip->reg_ctrl, cmd[i]);
+	}
+    lcd_select(lcd, sel);
+}
+
+    /*
+     *  Show the cursor on the selected controller only, after selecting
+     *  another one
+     */
+
+static void lcd_move_cursor(struct lcd_device *lcd)
+{
+    if (lcd->nchips > 1 && lcd_ctrl_stale(lcd))
+	lcd_write_ctrl(lcd);
+}
+
+void lcd_ctrl(struct lcd_device *lcd, int display, int cursor, int blink)
+{
+    lcd->ctrl = LCD_CMD_CTRL | display | cursor | blink;
+    lcd_write_ctrl(lcd);
+}
+
+void lcd_func(struct lcd_device *lcd, int datalen, int lines, int font)
+{
+    lcd_write_reg(lcd, lcd->chip->reg_func,
+		  LCD_CMD_FUNC | datalen | lines | font);
+}
+
+void lcd_cgram(struct lcd_device *lcd, u8 a)
+{
+    int reg = !lcd->chip->ac_cgram || lcd->chip->ac < 0 ? -1
+	      : LCD_CMD_CGRAM | lcd->chip->ac;
+
+    a &= LCD_CGRAM_MASK;
+    lcd_write_reg(lcd, reg, LCD_CMD_CGRAM | a);
+}
+
+void lcd_ddram(struct lcd_device *lcd, u8 a)
+{
+    int reg = lcd->chip->ac_cgram || lcd->chip->ac < 0 ? -1
+	      : LCD_CMD_DDRAM | lcd->chip->ac;
+
+    a &= LCD_DDRAM_MASK;
+    lcd_write_reg(lcd, reg, LCD_CMD_DDRAM | a);
+}
+
+    /*
+     *  Select the controller showing a cell, and move to it
+     */
+
+void lcd_goto(struct lcd_device *lcd, int x, int y)
+{
+    lcd_select(lcd, y/lcd->chip_rows);
+    lcd_ddram(lcd, lcd_cell_addr(lcd, x, y));
+}
+
+
+    /*
+     *  Write Pacing
+     */
+
+/* Give up polling the busy flag this long after the start, in us */
+#define LCD_BUSY_TIMEOUT_US(t)	(2*(t)+10)
+
+int lcd_set_pacing(struct lcd_device *lcd, int pacing)
+{
+    int old = lcd->pacing;
+
+    lcd->pacing = pacing;
+    return old;
+}
+
+static unsigned int lcd_exec_time(u8 val, int rs)
+{
+    if (!rs && (val == LCD_CMD_CLR || (val & ~1) == LCD_CMD_HOME))
+	return LCD_DELAY_CLR;
+    return LCD_DELAY_WRITE_US;
+}
 
-static unsigned long loops_per_jiffy = 1;
-static unsigned long max_udelay;
+    /*
+     *  Instead of waiting for the LCD right after a transfer, we remember when
+     *  it will be ready, and only wait if the next transfer comes too early.
+     *  This lets the caller's work overlap with the LCD's execution time.
+     */
 
-static void delay(unsigned long loops)
+static void lcd_set_ready(struct lcd_device *lcd, unsigned int usecs)
 {
-    long i;
+    lcd_clock_sync(lcd);
+    lcd->chip->ready_at = lcd_deadline_us(usecs);
+    lcd->chip->pending = usecs;
+}
 
-    for (i = loops; i >= 0 ; i--)
-	__asm__ __volatile__("" : : : "memory");
+static void lcd_wait_ready(struct lcd_device *lcd)
+{
+    unsigned long start, timeout;
+    unsigned int waited;
+    long left;
+
+    lcd_clock_sync(lcd);
+    if (!lcd->chip->pending)
+	return;
+    if (lcd->seq_recording) {
+	/* Nothing overlaps with the execution time during replay */
+	lcd_seq_delay(lcd, lcd->chip->pending*1000UL);
+	lcd->chip->pending = 0;
+	return;
+    }
+    start = lcd_now_us();
+    left = (long)(lcd->chip->ready_at-start);
+    if (left > (long)lcd->chip->pending)
+	left = lcd->chip->pending;
+    waited = 0;
+    if (left > 0) {
+	if (lcd->pacing == LCD_PACING_BUSY) {
+	    timeout = start+LCD_BUSY_TIMEOUT_US(left);
+	    while (1) {
+		lcd->stats.poll++;
+		if (!(lcd_xfer_read(lcd, 0) & LCD_BUSY))
+		    break;
+		if ((long)(lcd_now_us()-timeout) >= 0) {
+		    /* Not responding, fall back to fixed delays */
+		    lcd->stats.timeout++;
+		    lcd->pacing = LCD_PACING_DELAY;
+		    lcd_delay(lcd, left*1000UL);
+		    break;
+		}
+		lcd_delay_strobe(lcd);
+	    }
+	    waited = lcd_now_us()-start;
+	} else {
+	    lcd_delay(lcd, left*1000UL);
+	    waited = left;
+	}
+    }
+    if (waited < lcd->chip->pending)
+	lcd->stats.overlap_us += lcd->chip->pending-waited;
+    lcd->chip->pending = 0;
+    lcd_clock_sync(lcd);
 }
 
-#define HZ			100
-#define CLOCKS_PER_JIFFY	((CLOCKS_PER_SEC+HZ-1)/HZ)
-#define LPS_PREC		8
+    /*
+     *  Wait until the LCD has finished the last operation
+     */
 
-static void calibrate_delay(void)
+void lcd_sync(struct lcd_device *lcd)
 {
-    unsigned long ticks;
+    int sel = lcd_chip_num(lcd), i;
+
+    for (i = 0; i < lcd->nchips; i++) {
+	lcd_select(lcd, i);
+	lcd_wait_ready(lcd);
+    }
+    lcd_select(lcd, sel);
+}
 
-    printf("Calibrating delay loop.. ");
-    fflush(stdout);
+static void lcd_seq_track(struct lcd_device *lcd, u8 val, int rs);
+static void lcd_seq_xfer(struct lcd_device *lcd, u8 val, int rs);
 
-    loops_per_jiffy = (1<<12);
+    /*
+     *  Every selected controller is tracked and waited for separately, with
+     *  only its own E line selected, so busy flag polling reads just one
+     */
 
-    while ((loops_per_jiffy <<= 1)) {
-	ticks = clock();
-	delay(loops_per_jiffy);
-	ticks = clock() - ticks;
-	if (ticks >= CLOCKS_PER_JIFFY) {
-	    loops_per_jiffy = (loops_per_jiffy / ticks) * CLOCKS_PER_JIFFY;
-	    printf("ok - %lu.%02lu BogoMips\n\n", loops_per_jiffy/(500000/HZ),
-		   (loops_per_jiffy/(5000/HZ)) % 100);
-	    max_udelay = 0xffffffff/loops_per_jiffy;
-	    return;
+static void lcd_write_broadcast(struct lcd_device *lcd, u8 val, int rs)
+{
+    struct lcd_chip *sel = lcd->chip;
+    unsigned int mask = lcd->e_mask;
+    int i, n = 0;
+
+    for (i = 0; i < lcd->nchips; i++)
+	if (mask & (1 << i)) {
+	    lcd->chip = &lcd->chips[i];
+	    lcd->e_mask = 1 << i;
+	    lcd_track(lcd, val, rs);
+	    if (lcd_driver(lcd))
+		lcd_wait_ready(lcd);
+	    n++;
 	}
+    lcd->e_mask = mask;
+    if (lcd_driver(lcd)) {
+	lcd_xfer_write(lcd, val, rs);
+	for (i = 0; i < lcd->nchips; i++)
+	    if (mask & (1 << i)) {
+		lcd->chip = &lcd->chips[i];
+		lcd_set_ready(lcd, lcd_exec_time(val, rs));
+	    }
     }
-    printf("failed\n");
-    exit(-1);
+    lcd->chip = sel;
+    lcd->stats.broadcast += (n-1)*(lcd->width == 4 ? 2 : 1);
 }
 
-static void udelay(unsigned long usecs)
+void __lcd_write(struct lcd_device *lcd, u8 val, int rs)
 {
-    while (usecs > max_udelay) {
-	delay(0xffffffff/1000000);
-	usecs -= max_udelay;
+    if (!lcd->seq_recording)
+	lcd->stats.write++;
+    if (lcd_broadcasting(lcd)) {
+	lcd_write_broadcast(lcd, val, rs);
+	return;
+    }
+    if (lcd->seq_recording)
+	lcd_seq_track(lcd, val, rs);
+    lcd_track(lcd, val, rs);
+    if (lcd_driver(lcd)) {
+	lcd_wait_ready(lcd);
+	if (lcd->seq_recording)
+	    lcd_seq_xfer(lcd, val, rs);
+	else
+	    lcd_xfer_write(lcd, val, rs);
+	lcd_set_ready(lcd, lcd_exec_time(val, rs));
     }
-    delay(usecs*loops_per_jiffy/(1000000/HZ));
 }
 
-#endif /* !__KERNEL__ */
+    /*
+     *  Write a run of bytes. Drivers that can take them at once call
+     *  lcd_wait_write() between the bytes, which only works with fixed delays,
+     *  and for data (all commands but clear and home take as long as a data
+     *  write, but the planner never sends runs of commands anyway)
+     */
 
-#include "hd44780.h"
+void __lcd_write_vec(struct lcd_device *lcd, const u8 *buf, unsigned int n,
+		     int rs)
+{
+    unsigned int i;
+
+    if (!lcd_driver(lcd) || !lcd_driver(lcd)->write_vec || !rs ||
+	lcd->pacing != LCD_PACING_DELAY || lcd->seq_recording ||
+	lcd_broadcasting(lcd)) {
+	while (n--)
+	    __lcd_write(lcd, *buf++, rs);
+	return;
+    }
+    if (!n)
+	return;
+    lcd->stats.write += n;
+    for (i = 0; i < n; i++)
+	lcd_track(lcd, buf[i], rs);
+    lcd_wait_ready(lcd);
+    lcd_driver(lcd)->write_vec(lcd, buf, n, rs);
+    lcd_set_ready(lcd, LCD_DELAY_WRITE_US);
+}
 
+    /*
+     *  The previous byte of the run has been written, wait until its
+     *  execution deadline has passed
+     */
 
-#define LCD_COLS	20
-#define LCD_ROWS	4
+void lcd_wait_write(struct lcd_device *lcd)
+{
+    lcd_set_ready(lcd, LCD_DELAY_WRITE_US);
+    lcd_wait_ready(lcd);
+}
 
-static int lcd_col = 0, lcd_row = 0;
-#ifdef SCROLL_REDRAW
-static char lcd_data[LCD_COLS*LCD_ROWS];
-#endif /* SCROLL_REDRAW */
+u8 __lcd_read(struct lcd_device *lcd, int rs)
+{
+    unsigned int mask = lcd->e_mask;
+    u8 val = 0;
 
-static const unsigned int lcd_row_offset[LCD_ROWS] = { 0, 64, 20, 84 };
+    if (lcd->seq_recording) {
+	/* Can't be replayed */
+	lcd->seq_recording->overflow = 1;
+	return 0;
+    }
+    lcd_clock_sync(lcd);
+    /* Only one controller can drive the bus */
+    lcd->e_mask = 1 << lcd_chip_num(lcd);
+
+    lcd->stats.read++;
+    if (rs)
+	lcd_track(lcd, 0, 1);
+    if (lcd_driver(lcd)) {
+	if (rs) {
+	    /* Reading data is an operation, reading the busy flag is not */
+	    lcd_wait_ready(lcd);
+	    val = lcd_xfer_read(lcd, rs);
+	    lcd_set_ready(lcd, LCD_DELAY_READ_US);
+	} else {
+	    val = lcd_xfer_read(lcd, rs);
+	    lcd_delay_strobe(lcd);
+	}
+    }
+    lcd->e_mask = mask;
+    return val;
+}
 
 
-#define LCD_DELAY_STROBE_US	1
-#define LCD_DELAY_WRITE_US	50
-#define LCD_DELAY_READ_US	6
-#define LCD_DELAY_CLR		1437
+/* ------------------------------------------------------------------------- */
 
-static inline void lcd_delay_strobe(void) { udelay(LCD_DELAY_STROBE_US); }
-static inline void lcd_delay_write(void) { udelay(LCD_DELAY_WRITE_US); }
-static inline void lcd_delay_read(void) { udelay(LCD_DELAY_READ_US); }
-static inline void lcd_delay_clr(void) { udelay(LCD_DELAY_CLR); }
 
     /*
-     *  Mid-Level LCD Access
+     *  Compiled Sequences
      */
 
-static int lcd_current_width = 8;	/* The HD44780 boots up in 8-bit mode */
+static void lcd_seq_add(struct lcd_device *lcd, u8 op, u8 val, u8 data,
+			unsigned int arg)
+{
+    struct lcd_seq *seq = lcd->seq_recording;
+    struct lcd_step *step;
+
+    if (seq->n == LCD_SEQ_MAX) {
+	seq->overflow = 1;
+	return;
+    }
+    step = &seq->step[seq->n++];
+    step->op = op;
+    step->val = val;
+    step->data = data;
+    step->arg = arg;
+}
 
-static const struct lcd_driver *lcd_driver = NULL;
+static void lcd_seq_delay(struct lcd_device *lcd, unsigned long nsecs)
+{
+    struct lcd_seq *seq = lcd->seq_recording;
 
-static unsigned int lcd_stat_write = 0, lcd_stat_read = 0;
+    if (seq->n && seq->step[seq->n-1].op == LCD_SEQ_DELAY)
+	seq->step[seq->n-1].arg += nsecs;
+    else
+	lcd_seq_add(lcd, LCD_SEQ_DELAY, 0, 0, nsecs);
+}
 
+    /*
+     *  Called by drivers instead of writing to a port. As the port's value at
+     *  replay time is unknown, the first write to each port is always kept.
+     */
 
-void lcd_register_driver(const struct lcd_driver *driver)
+void lcd_seq_out(struct lcd_device *lcd, unsigned int port, u8 val, int data)
 {
-    lcd_driver = driver;
+    struct lcd_seq *seq = lcd->seq_recording;
+
+    if (port >= LCD_SEQ_PORTS) {
+	seq->overflow = 1;
+	return;
+    }
+    /* Data bytes may be patched, so they are never skipped */
+    if (!data && seq->last[port] >= 0 && seq->step[seq->last[port]].val == val)
+	return;
+    if (seq->n < LCD_SEQ_MAX)
+	seq->last[port] = seq->n;
+    lcd_seq_add(lcd, LCD_SEQ_OUT, val, data ? LCD_SEQ_BYTE : 0, port);
 }
 
-void lcd_unregister_driver(const struct lcd_driver *driver)
+    /*
+     *  Note which cells of the text layer a transfer changes, before it moves
+     *  the address counter
+     */
+
+static void lcd_seq_track(struct lcd_device *lcd, u8 val, int rs)
 {
-    lcd_driver = NULL;
+    struct lcd_seq *seq = lcd->seq_recording;
+    int ac = lcd->chip->ac, mode = lcd->chip->reg_mode, cell;
+
+    if (rs && ac >= 0 && (mode < 0 || !(mode & LCD_SHIFT_ON))) {
+	if (!lcd->chip->ac_cgram && (cell = lcd->addr_cell[ac]) >= 0)
+	    seq->written[cell] = 1;
+    } else if (rs || val == LCD_CMD_CLR ||
+	       (val & ~7) == (LCD_CMD_SHIFT | LCD_SHIFT_DISP))
+	/* Unknown address, or all cells change or move */
+	memset(seq->written, 1, sizeof(seq->written));
 }
 
-void __lcd_write(u8 val, int rs)
+    /*
+     *  Record a transfer, and find the steps that carry the byte
+     */
+
+static void lcd_seq_xfer(struct lcd_device *lcd, u8 val, int rs)
 {
-    lcd_stat_write++;
-    if (lcd_driver) {
-	if (lcd_driver->write)
-	    lcd_driver->write(val, rs);
-	else {
-	    lcd_driver->set_rs_rw(rs, 0);
-	    if (lcd_current_width == 4) {
-		/* Write High Nibble */
-		lcd_driver->set_data(val);
-		lcd_driver->set_e(1);
-		lcd_delay_strobe();
-		lcd_driver->set_e(0);
-		lcd_delay_strobe();
-		/* Write Low Nibble */
-		val <<= 4;
-	    }
-	    lcd_driver->set_data(val);
-	    lcd_driver->set_e(1);
-	    lcd_delay_strobe();
-	    lcd_driver->set_e(0);
-	    /* Pause */
-	    lcd_delay_write();
-	}
+    struct lcd_seq *seq = lcd->seq_recording;
+    unsigned int first = seq->n, i, nibble = 0;
+
+    lcd_xfer_write(lcd, val, rs);
+    seq->writes++;
+    if (!rs)
+	return;
+    if (seq->slots == LCD_SEQ_SLOTS) {
+	seq->overflow = 1;
+	return;
     }
+    seq->slot[seq->slots++] = first;
+    if (lcd->width == 8)
+	return;
+    for (i = first; i < seq->n; i++)
+	if (seq->step[i].data)
+	    seq->step[i].data = nibble++ ? LCD_SEQ_LOW : LCD_SEQ_HIGH;
 }
 
-u8 __lcd_read(int rs)
+static void lcd_save_regs(struct lcd_device *lcd, int *regs)
 {
-    u8 val = 0;
+    regs[0] = lcd->chip->ac;
+    regs[1] = lcd->chip->ac_cgram;
+    regs[2] = lcd->chip->ac_inc;
+    regs[3] = lcd->chip->reg_mode;
+    regs[4] = lcd->chip->reg_ctrl;
+    regs[5] = lcd->chip->reg_func;
+}
 
-    lcd_stat_read++;
-    if (lcd_driver) {
-	if (lcd_driver->read)
-	    val = lcd_driver->read(rs);
-	else {
-	    lcd_driver->set_rs_rw(rs, 1);
-	    /* Read Byte or High Nibble */
-	    lcd_driver->set_e(1);
-	    lcd_delay_strobe();
-	    val = lcd_driver->get_data();
-	    lcd_driver->set_e(0);
-	    if (lcd_current_width == 4) {
-		val &= 0xf0;
-		lcd_delay_strobe();
-		/* Read Low Nibble */
-		lcd_driver->set_e(1);
-		lcd_delay_strobe();
-		val |= lcd_driver->get_data() >> 4;
-		lcd_driver->set_e(0);
-	    }
-	    /* Pause */
-	    lcd_delay_read();
+static void lcd_restore_regs(struct lcd_device *lcd, const int *regs)
+{
+    lcd->chip->ac = regs[0];
+    lcd->chip->ac_cgram = regs[1];
+    lcd->chip->ac_inc = regs[2];
+    lcd->chip->reg_mode = regs[3];
+    lcd->chip->reg_ctrl = regs[4];
+    lcd->chip->reg_func = regs[5];
+}
+
+    /*
+     *  Start recording. Fails if the driver can't replay sequences, in which
+     *  case the operations should just be done directly.
+     */
+
+int lcd_seq_begin(struct lcd_device *lcd, struct lcd_seq *seq)
+{
+    unsigned int i;
+
+    if (!lcd_driver(lcd) || !lcd_driver(lcd)->run_seq || lcd->seq_recording)
+	return -1;
+    lcd_wait_ready(lcd);
+    seq->n = seq->slots = seq->writes = seq->pending = 0;
+    seq->width = lcd->width;
+    seq->overflow = 0;
+    seq->chip = lcd_chip_num(lcd);
+    for (i = 0; i < LCD_SEQ_PORTS; i++)
+	seq->last[i] = -1;
+    memset(seq->written, 0, sizeof(seq->written));
+    /* The sequence can't depend on what the controller contains now */
+    lcd_save_regs(lcd, lcd->seq_regs);
+    lcd_invalidate_chip(lcd->chip);
+    lcd->seq_pacing = lcd_set_pacing(lcd, LCD_PACING_DELAY);
+    lcd->seq_recording = seq;
+    return 0;
+}
+
+    /*
+     *  Stop recording. Nothing was sent to the LCD, so its state is unchanged
+     */
+
+int lcd_seq_end(struct lcd_device *lcd, struct lcd_seq *seq)
+{
+    seq->pending = lcd->chip->pending;
+    lcd->chip->pending = 0;
+    lcd->seq_recording = NULL;
+    lcd_set_pacing(lcd, lcd->seq_pacing);
+    lcd_save_regs(lcd, seq->regs);
+    lcd_restore_regs(lcd, lcd->seq_regs);
+    return seq->overflow ? -1 : 0;
+}
+
+void lcd_seq_patch(struct lcd_seq *seq, unsigned int slot, u8 val)
+{
+    struct lcd_step *step;
+
+    if (slot >= seq->slots)
+	return;
+    for (step = &seq->step[seq->slot[slot]]; step < &seq->step[seq->n];
+	 step++)
+	switch (step->data) {
+	    case LCD_SEQ_BYTE:
+		step->val = val;
+		return;
+
+	    case LCD_SEQ_HIGH:
+		step->val = (step->val & 0x0f) | (val & 0xf0);
+		break;
+
+	    case LCD_SEQ_LOW:
+		step->val = (step->val & 0x0f) | (val << 4);
+		return;
 	}
-    }
-    return val;
+}
+
+int lcd_seq_run(struct lcd_device *lcd, const struct lcd_seq *seq)
+{
+    const char *data;
+    char *shadow;
+    int i;
+
+    if (!lcd_driver(lcd) || !lcd_driver(lcd)->run_seq || seq->overflow ||
+	seq->width != lcd->width || lcd->seq_recording)
+	return -1;
+    lcd_select(lcd, seq->chip);
+    lcd_wait_ready(lcd);
+    lcd_driver(lcd)->run_seq(lcd, seq);
+    lcd->stats.write += seq->writes;
+    lcd_restore_regs(lcd, seq->regs);
+    lcd_set_ready(lcd, seq->pending);
+    /* The text layer no longer knows what these cells show */
+    shadow = &lcd->shadow[seq->chip*lcd->chip_cells];
+    data = &lcd->data[seq->chip*lcd->chip_cells];
+    for (i = 0; i < lcd->chip_cells; i++)
+	if (seq->written[i])
+	    shadow[i] = ~data[i];
+    return 0;
 }
 
 
@@ -205,24 +1232,33 @@ u8 __lcd_read(int rs)
      *  Clear Display
      */
 
-void lcd_clr(void)
+    /*
+     *  Both are broadcast to all controllers, and select the first one, which
+     *  gets the cursor
+     */
+
+void lcd_clr(struct lcd_device *lcd)
 {
-    lcd_write_cmd(LCD_CMD_CLR);
-    lcd_delay_clr();
-    lcd_col = lcd_row = 0;
-#ifdef SCROLL_REDRAW
-    memset(lcd_data, ' ', LCD_COLS*LCD_ROWS);
-#endif /* SCROLL_REDRAW */
+    lcd_select_all(lcd);
+    lcd_write_cmd(lcd, LCD_CMD_CLR);
+    lcd_select(lcd, 0);
+    lcd_move_cursor(lcd);
+    lcd->col = lcd->row = 0;
+    memset(lcd->data, ' ', lcd->cells);
+    memset(lcd->shadow, ' ', lcd->cells);
 }
 
     /*
      *  Return Home
      */
 
-void lcd_home(void)
+void lcd_home(struct lcd_device *lcd)
 {
-    lcd_write_cmd(LCD_CMD_HOME);
-    lcd_col = lcd_row = 0;
+    lcd_select_all(lcd);
+    lcd_write_cmd(lcd, LCD_CMD_HOME);
+    lcd_select(lcd, 0);
+    lcd_move_cursor(lcd);
+    lcd->col = lcd->row = 0;
 }
 
 
@@ -233,33 +1269,49 @@ void lcd_home(void)
 #define LCD_BUSY	(128)
 #define LCD_ADDR_MASK	(127)
 
-int lcd_is_busy(u8 *addr)
+int lcd_is_busy(struct lcd_device *lcd, u8 *addr)
 {
-    u8 val = lcd_read_cmd();
+    u8 val = lcd_read_cmd(lcd);
 
+    if (!(val & LCD_BUSY))
+	lcd->chip->ac = val & LCD_ADDR_MASK;
     if (addr)
 	*addr = val & LCD_ADDR_MASK;
     return val & LCD_BUSY ? 1 : 0;
 }
 
 
-void lcd_backlight(int light)
+void lcd_backlight(struct lcd_device *lcd, int light)
 {
-    if (lcd_driver)
-	lcd_driver->set_bl(light);
+    if (lcd_driver(lcd))
+	lcd_driver(lcd)->set_bl(lcd, light);
 }
 
 
     /*
-     *  Device-Specific Initialization for a 20x4 LCD
+     *  Device-Specific Initialization
      */
 
 #ifdef __KERNEL__
+static void lcd_kernel_init(struct lcd_device *lcd);
+static void lcd_kernel_cleanup(struct lcd_device *lcd);
+static void lcd_log_kick(struct lcd_device *lcd);
+
+    /*
+     *  Kernel messages and lcdcon go to the first display that is initialized
+     */
+
+struct lcd_device *lcd_console_dev = NULL;
+
 static void lcd_console_write(struct console *console, const char *s,
 			      unsigned count)
 {
-    while (count--)
-	lcd_putc(*s++);
+    struct lcd_device *lcd = lcd_console_dev;
+
+    if (!lcd)
+	return;
+    lcd_log_write(lcd, s, count);
+    lcd_log_kick(lcd);
 }
 
 static struct console lcd_console = {
@@ -271,60 +1323,379 @@ static struct console lcd_console = {
 };
 #endif /* __KERNEL__ */
 
-void lcd_init(int width)
+    /*
+     *  Build the address tables once, so the update planner and the text
+     *  layer only have to index them. Returns -1 for unsupported geometries.
+     */
+
+int lcd_set_geometry(struct lcd_device *lcd, int cols, int rows)
+{
+    u8 pos_addr[LCD_DDRAM_CELLS];
+    int x, y, ly, addr, pos, cell, i;
+
+    if (cols < 1 || (rows != 1 && rows != 2 && rows != 4) ||
+	cols*rows > LCD_CELLS_MAX || (rows < 4 && cols*rows > LCD_DDRAM_CELLS))
+	return -1;
+    lcd->cols = cols;
+    lcd->rows = rows;
+    lcd->cells = cols*rows;
+    lcd->nchips = lcd->cells > LCD_DDRAM_CELLS ? 2 : 1;
+    lcd->chip_rows = rows/lcd->nchips;
+    lcd->chip_cells = cols*lcd->chip_rows;
+    lcd->lines = lcd->chip_rows == 1 ? LCD_LINES_1 : LCD_LINES_2;
+    lcd_select(lcd, 0);
+
+    /* 1-line mode runs through 0x00-0x4f, 2-line mode through 0x00-0x27 and
+       0x40-0x67, both wrapping around */
+    memset(lcd->addr_pos, LCD_POS_NONE, sizeof(lcd->addr_pos));
+    for (pos = 0; pos < LCD_DDRAM_CELLS; pos++) {
+	addr = lcd->lines == LCD_LINES_1 || pos < LCD_LINE_LEN ? pos
+	       : pos-LCD_LINE_LEN+LCD_LINE2;
+	lcd->addr_pos[addr] = pos;
+	pos_addr[pos] = addr;
+    }
+    for (pos = 0; pos < LCD_DDRAM_CELLS; pos++) {
+	addr = pos_addr[pos];
+	lcd->addr_next[addr] = pos_addr[(pos+1) % LCD_DDRAM_CELLS];
+	lcd->addr_prev[addr] = pos_addr[(pos+LCD_DDRAM_CELLS-1) %
+					LCD_DDRAM_CELLS];
+    }
+
+    /*
+     *  The second half of a 4-row display continues the first two rows. All
+     *  controllers have the same layout, the other tables are for the first.
+     */
+    for (addr = 0; addr <= LCD_DDRAM_MASK; addr++)
+	lcd->addr_cell[addr] = -1;
+    for (y = 0; y < rows; y++)
+	for (x = 0; x < cols; x++) {
+	    ly = y % lcd->chip_rows;
+	    addr = (ly & 1)*LCD_LINE2 + (ly >> 1)*cols + x;
+	    lcd->cell_addr[y*cols+x] = addr;
+	    if (y == ly)
+		lcd->addr_cell[addr] = y*cols+x;
+	}
+
+    for (pos = 0, i = 0; pos < LCD_DDRAM_CELLS; pos++) {
+	lcd->pos_order[pos] = i < lcd->chip_cells ? i : 0;
+	cell = lcd->addr_cell[pos_addr[pos]];
+	if (cell >= 0)
+	    lcd->cell_order[i++] = cell;
+    }
+
+    lcd->col = lcd->row = 0;
+    memset(lcd->data, ' ', lcd->cells);
+    memset(lcd->shadow, ' ', lcd->cells);
+    return 0;
+}
+
+void lcd_init(struct lcd_device *lcd, int width)
 {
+    int pacing;
+
 #ifdef __KERNEL__
     if (loops_per_jiffy == (1<<12)) {
 	printk("lcd_init: delay loop not yet calibrated\n");
 	loops_per_jiffy = 50000000;	/* Safe for <= 10000 BogoMIPS */
     }
+    if (!lcd_cycles_per_us)
+	lcd_calibrate_cycles();
 #else /* !__KERNEL__ */
-    if (loops_per_jiffy == 1)
-	calibrate_delay();
+    lcd->start_ns = lcd_real_now_ns();
+    lcd->start_cpu_ns = lcd_cpu_ns();
+    lcd_clock_sync(lcd);
+    lcd->start_clock_ns = lcd_clock_ns();
 #endif /* !__KERNEL__ */
     MOD_INC_USE_COUNT;
 
+    /* The busy flag cannot be checked before the interface width is set */
+    pacing = lcd_set_pacing(lcd, LCD_PACING_DELAY);
+    lcd_invalidate(lcd);
+
+    /* All controllers are in the same mode, set them up at once */
+    lcd_select_all(lcd);
     switch (width) {
 	case 8:
-	    lcd_func(LCD_DATALEN_8, LCD_LINES_2, LCD_FONT_5x8);
-	    lcd_current_width = 8;
+	    lcd_func(lcd, LCD_DATALEN_8, lcd->lines, LCD_FONT_5x8);
+	    lcd->width = 8;
 	    break;
 
 	case 4:
-	    lcd_func(LCD_DATALEN_4, LCD_LINES_2, LCD_FONT_5x8);
-	    if (lcd_current_width == 8) {
-		lcd_current_width = 4;
-		lcd_func(LCD_DATALEN_4, LCD_LINES_2, LCD_FONT_5x8);
+	    lcd_func(lcd, LCD_DATALEN_4, lcd->lines, LCD_FONT_5x8);
+	    if (lcd->width == 8) {
+		/* The first one was a 8-bit transfer, repeat it */
+		lcd->width = 4;
+		lcd_write_cmd(lcd, LCD_CMD_FUNC | LCD_DATALEN_4 | lcd->lines |
+			      LCD_FONT_5x8);
 	    }
 	    break;
     }
-    lcd_ctrl(LCD_DISP_ON, LCD_CURSOR_ON, LCD_BLINK_ON);
-    lcd_mode(LCD_INC, LCD_SHIFT_OFF);
-    lcd_clr();
+    lcd_set_pacing(lcd, pacing);
+    lcd_select(lcd, 0);
+    lcd_ctrl(lcd, LCD_DISP_ON, LCD_CURSOR_ON, LCD_BLINK_ON);
+    lcd_select_all(lcd);
+    lcd_mode(lcd, LCD_INC, LCD_SHIFT_OFF);
+    lcd_clr(lcd);
 
 #ifdef __KERNEL__
-    if (lcd_console_messages)
-	register_console(&lcd_console);
+    lcd_kernel_init(lcd);
+    if (!lcd_console_dev) {
+	lcd_console_dev = lcd;
+	if (lcd_console_messages)
+	    register_console(&lcd_console);
+    }
 #endif /* __KERNEL__ */
 }
 
-void lcd_cleanup(void)
+void lcd_cleanup(struct lcd_device *lcd)
 {
+    int old, i;
+
 #ifdef __KERNEL__
-    if (lcd_console_messages)
-	unregister_console(&lcd_console);
+    if (lcd == lcd_console_dev) {
+	if (lcd_console_messages)
+	    unregister_console(&lcd_console);
+	lcd_console_dev = NULL;
+    }
+    lcd_kernel_cleanup(lcd);
 #else
-    printf("Statistics: %d writes, %d reads\n", lcd_stat_write, lcd_stat_read);
+    printf("Statistics: %lu writes, %lu reads, %lu polls, %lu timeouts, "
+	   "%lu elided, %lu port accesses\n", lcd->stats.write, lcd->stats.read,
+	   lcd->stats.poll, lcd->stats.timeout, lcd->stats.elided, lcd->stats.io);
+    printf("Planner: cost %lu (full redraws %lu)\n", lcd->stats.cost,
+	   lcd->stats.cost_redraw);
+    printf("Log: %lu chars, %lu filtered, %lu dropped\n", lcd->stats.log,
+	   lcd->stats.log_filtered, lcd->stats.log_dropped);
+    printf("Pacing: %lu us overlapped with LCD execution\n",
+	   lcd->stats.overlap_us);
+    if (lcd->nchips > 1)
+	printf("Broadcast: %lu bus cycles saved\n", lcd->stats.broadcast);
+    printf("Timing: %llu ms wall, %llu ms CPU, %llu ms delays (%llu ms "
+	   "asleep)\n", (lcd_real_now_ns()-lcd->start_ns)/1000000,
+	   (lcd_cpu_ns()-lcd->start_cpu_ns)/1000000,
+	   lcd->stats.delay_ns/1000000, lcd->stats.sleep_ns/1000000);
+    lcd_clock_sync(lcd);
+    if (lcd_clock != &lcd_clock_real)
+	printf("Clock: %llu ms %s time\n",
+	       (lcd_clock_ns()-lcd->start_clock_ns)/1000000, lcd_clock->name);
 #endif /* __KERNEL__ */
 
     /* Return to 8-bit mode */
-    lcd_func(LCD_DATALEN_8, LCD_LINES_2, LCD_FONT_5x8);
-    lcd_current_width = 8;
+    old = lcd->width;
+    for (i = 0; i < lcd->nchips; i++) {
+	lcd_select(lcd, i);
+	lcd->width = old;
+	lcd_func(lcd, LCD_DATALEN_8, LCD_LINES_2, LCD_FONT_5x8);
+	lcd->width = 8;
+	lcd_wait_ready(lcd);
+    }
 
     MOD_DEC_USE_COUNT;
 }
 
 
+/* ------------------------------------------------------------------------- */
+
+
+    /*
+     *  Update Planner
+     *
+     *  In 2-line mode the address counter runs through 0x00-0x27, continues
+     *  at 0x40-0x67, and wraps back to 0x00, so all cells form one cyclic
+     *  sequence. In 1-line mode it runs through 0x00-0x4f. A dirty cell can be
+     *  reached either by setting the address, or by rewriting the cells in
+     *  between with their new contents.
+     */
+
+static const struct lcd_cost lcd_default_cost = {
+    write:	LCD_DELAY_WRITE_US,
+    addr:	LCD_DELAY_WRITE_US,
+    clr:	LCD_DELAY_CLR
+};
+
+static inline const struct lcd_cost *lcd_cost(struct lcd_device *lcd)
+{
+    if (lcd_driver(lcd) && lcd_driver(lcd)->cost)
+	return lcd_driver(lcd)->cost;
+    return &lcd_default_cost;
+}
+
+static void lcd_plan_op(struct lcd_plan *plan, u8 type, u8 addr)
+{
+    struct lcd_op *op;
+
+    if (!plan)
+	return;
+    if (type == LCD_OP_DATA && plan->n &&
+	plan->op[plan->n-1].type == LCD_OP_DATA) {
+	plan->op[plan->n-1].len++;
+	return;
+    }
+    op = &plan->op[plan->n++];
+    op->type = type;
+    op->addr = addr;
+    op->len = 1;
+}
+
+    /*
+     *  Plan without clearing. If plan is NULL, only the cost is calculated
+     */
+
+static unsigned int lcd_plan_diff(struct lcd_device *lcd,
+				  struct lcd_plan *plan, const char *old,
+				  const char *new, int ac, int cursor)
+{
+    const struct lcd_cost *cost = lcd_cost(lcd);
+    unsigned int total = 0;
+    int known, addr, cell, i, k, gap;
+
+    /* Visit the visible cells in address counter order, starting at ac */
+    known = lcd_valid_addr(lcd, ac);
+    k = known ? lcd->pos_order[lcd->addr_pos[ac]] : 0;
+    for (i = 0; i < lcd->chip_cells; i++) {
+	cell = lcd->cell_order[k];
+	k = k+1 < lcd->chip_cells ? k+1 : 0;
+	if ((old ? old[cell] : ' ') == new[cell])
+	    continue;
+	addr = lcd->cell_addr[cell];
+	/* gap counts the clean cells since the address counter */
+	gap = known ? lcd_addr_dist(lcd, ac, addr) : -1;
+	if (gap < 0 || gap*cost->write > cost->addr) {
+	    lcd_plan_op(plan, LCD_OP_ADDR, addr);
+	    total += cost->addr;
+	} else {
+	    total += gap*cost->write;
+	    for (; ac != addr; ac = lcd_next_addr(lcd, ac))
+		lcd_plan_op(plan, LCD_OP_DATA, ac);
+	}
+	lcd_plan_op(plan, LCD_OP_DATA, addr);
+	total += cost->write;
+	ac = lcd_next_addr(lcd, addr);
+	known = 1;
+    }
+
+    /* Move the address counter to the cursor */
+    if (!lcd_valid_addr(lcd, cursor) || ac == cursor)
+	return total;
+    if (known) {
+	gap = lcd_addr_dist(lcd, ac, cursor);
+	if (gap*cost->write <= cost->addr) {
+	    for (addr = ac; addr != cursor; addr = lcd_next_addr(lcd, addr))
+		lcd_plan_op(plan, LCD_OP_DATA, addr);
+	    return total+gap*cost->write;
+	}
+    }
+    lcd_plan_op(plan, LCD_OP_ADDR, cursor);
+    return total+cost->addr;
+}
+
+unsigned int lcd_plan(struct lcd_device *lcd, struct lcd_plan *plan,
+		      const char *old, const char *new, int ac, int cursor)
+{
+    unsigned int cost, clr_cost;
+
+    cost = lcd_plan_diff(lcd, NULL, old, new, ac, cursor);
+    clr_cost = lcd_cost(lcd)->clr +
+	       lcd_plan_diff(lcd, NULL, NULL, new, 0, cursor);
+    plan->n = 0;
+    if (clr_cost < cost) {
+	lcd_plan_op(plan, LCD_OP_CLR, 0);
+	lcd_plan_diff(lcd, plan, NULL, new, 0, cursor);
+	cost = clr_cost;
+    } else
+	lcd_plan_diff(lcd, plan, old, new, ac, cursor);
+    plan->cost = cost;
+    return cost;
+}
+
+    /*
+     *  Executes the plan on the selected controller
+     */
+
+void lcd_plan_exec(struct lcd_device *lcd, const struct lcd_plan *plan,
+		   const char *new)
+{
+    const struct lcd_op *op;
+    u8 buf[LCD_DDRAM_CELLS];
+    unsigned int i, j;
+    int addr, cell;
+
+    for (i = 0, op = plan->op; i < plan->n; i++, op++)
+	switch (op->type) {
+	    case LCD_OP_CLR:
+		lcd_write_cmd(lcd, LCD_CMD_CLR);
+		break;
+
+	    case LCD_OP_ADDR:
+		lcd_ddram(lcd, op->addr);
+		break;
+
+	    case LCD_OP_DATA:
+		for (j = 0, addr = op->addr; j < op->len;
+		     j++, addr = lcd_next_addr(lcd, addr)) {
+		    cell = lcd->addr_cell[addr];
+		    buf[j] = cell < 0 ? ' ' : new[cell];
+		}
+		lcd_write_vec(lcd, buf, op->len);
+		break;
+	}
+}
+
+    /*
+     *  Execute the plans of all controllers, alternating between them for
+     *  each transfer, so one controller is written to while the other one is
+     *  still busy
+     */
+
+static void lcd_plan_exec_chips(struct lcd_device *lcd)
+{
+    const struct lcd_op *op[LCD_CHIPS_MAX], *end[LCD_CHIPS_MAX];
+    unsigned int done[LCD_CHIPS_MAX];
+    int addr[LCD_CHIPS_MAX];
+    const char *new;
+    int i, cell, busy;
+
+    for (i = 0; i < lcd->nchips; i++) {
+	op[i] = lcd->plan[i].op;
+	end[i] = op[i]+lcd->plan[i].n;
+	done[i] = 0;
+    }
+    do {
+	busy = 0;
+	for (i = 0; i < lcd->nchips; i++) {
+	    if (op[i] == end[i])
+		continue;
+	    busy = 1;
+	    lcd_select(lcd, i);
+	    switch (op[i]->type) {
+		case LCD_OP_CLR:
+		    lcd_write_cmd(lcd, LCD_CMD_CLR);
+		    op[i]++;
+		    break;
+
+		case LCD_OP_ADDR:
+		    lcd_ddram(lcd, op[i]->addr);
+		    op[i]++;
+		    break;
+
+		case LCD_OP_DATA:
+		    if (!done[i])
+			addr[i] = op[i]->addr;
+		    new = &lcd->data[i*lcd->chip_cells];
+		    cell = lcd->addr_cell[addr[i]];
+		    lcd_write(lcd, cell < 0 ? ' ' : new[cell]);
+		    addr[i] = lcd_next_addr(lcd, addr[i]);
+		    if (++done[i] == op[i]->len) {
+			done[i] = 0;
+			op[i]++;
+		    }
+		    break;
+	    }
+	}
+    } while (busy);
+}
+
+
 /* ------------------------------------------------------------------------- */
 
 
@@ -334,157 +1705,381 @@ void lcd_cleanup(void)
      *  FIXME: split this off in a separate lcdtext module
      */
 
-static void lcd_write_vec(const char *data, unsigned int n)
+
+    /*
+     *  Write all cells that differ between data and shadow, and leave the
+     *  address counter at the cursor position
+     */
+
+    /*
+     *  Apply a plan to the shadows of all controllers, as if it had been
+     *  broadcast. Returns the resulting address counter.
+     */
+
+static int lcd_plan_apply(struct lcd_device *lcd, const struct lcd_plan *plan,
+			  char *shadow, const char *new, int ac)
 {
-    while (n--)
-	lcd_write(*data++);
+    const struct lcd_op *op;
+    unsigned int i, j;
+    int cell, c;
+
+    for (i = 0, op = plan->op; i < plan->n; i++, op++)
+	switch (op->type) {
+	    case LCD_OP_CLR:
+		memset(shadow, ' ', lcd->cells);
+		ac = 0;
+		break;
+
+	    case LCD_OP_ADDR:
+		ac = op->addr;
+		break;
+
+	    case LCD_OP_DATA:
+		for (j = 0, ac = op->addr; j < op->len;
+		     j++, ac = lcd_next_addr(lcd, ac))
+		    if ((cell = lcd->addr_cell[ac]) >= 0)
+			for (c = 0; c < lcd->nchips; c++)
+			    shadow[c*lcd->chip_cells+cell] = new[cell];
+		break;
+	}
+    return ac;
 }
 
-#ifdef SCROLL_REDRAW
-static void lcd_redraw_region(int sx, int sy, int width, int height)
+    /*
+     *  The plans assume that the address counter increments, and that writes
+     *  don't shift the display
+     */
+
+#define LCD_PLAN_MODE	(LCD_CMD_MODE | LCD_INC | LCD_SHIFT_OFF)
+
+static void lcd_plan_mode(struct lcd_device *lcd)
 {
-    int y;
+    int sel = lcd_chip_num(lcd), i;
 
-    for (y = sy; y < sy+height; y++) {
-	lcd_ddram(lcd_row_offset[y]+sx);
-	lcd_write_vec(&lcd_data[y*LCD_COLS+sx], width);
-    }
-    lcd_ddram(lcd_row_offset[lcd_row]+lcd_col);
+    for (i = 0; i < lcd->nchips; i++)
+	if (lcd->chips[i].reg_mode != LCD_PLAN_MODE) {
+	    lcd_select(lcd, i);
+	    lcd_mode(lcd, LCD_INC, LCD_SHIFT_OFF);
+	}
+    lcd_select(lcd, sel);
 }
 
-static inline void lcd_redraw(void)
+    /*
+     *  Broadcast the changes that are the same on all controllers, i.e. the
+     *  cells that have the same old and new contents on all of them. This is
+     *  only done if it plus the slowest of the remaining per-controller plans
+     *  is no slower than the slowest of the full ones, as those are executed
+     *  interleaved. Returns 1 if anything was broadcast. The per-controller
+     *  plans are used as scratch space.
+     */
+
+static int lcd_flush_shared(struct lcd_device *lcd, int cursor_chip)
 {
-    lcd_redraw_region(0, 0, LCD_COLS, LCD_ROWS);
+    char new[LCD_DDRAM_CELLS], shadow[LCD_CELLS_MAX];
+    unsigned int joint, rest = 0, split = 0, cost;
+    int cells = lcd->chip_cells, shared = 0, cell, cursor, ac, i;
+
+    for (cell = 0; cell < cells; cell++) {
+	new[cell] = lcd->shadow[cell];
+	for (i = 1; i < lcd->nchips; i++)
+	    if (lcd->shadow[i*cells+cell] != lcd->shadow[cell] ||
+		lcd->data[i*cells+cell] != lcd->data[cell])
+		break;
+	if (i == lcd->nchips && lcd->data[cell] != lcd->shadow[cell]) {
+	    new[cell] = lcd->data[cell];
+	    shared = 1;
+	}
+    }
+    if (!shared)
+	return 0;
+
+    /* Unless all address counters agree, the broadcast starts anywhere */
+    ac = lcd_chip_ac(&lcd->chips[0]);
+    for (i = 1; i < lcd->nchips; i++)
+	if (lcd_chip_ac(&lcd->chips[i]) != ac)
+	    ac = -1;
+    joint = lcd_plan(lcd, &lcd->shared_plan, lcd->shadow, new, ac, -1);
+    memcpy(shadow, lcd->shadow, lcd->cells);
+    ac = lcd_plan_apply(lcd, &lcd->shared_plan, shadow, new, ac);
+
+    for (i = 0; i < lcd->nchips; i++) {
+	cursor = i == cursor_chip ? lcd_cell_addr(lcd, lcd->col, lcd->row)
+				  : -1;
+	cost = lcd_plan(lcd, &lcd->plan[i], &lcd->shadow[i*cells],
+			&lcd->data[i*cells], lcd_chip_ac(&lcd->chips[i]),
+			cursor);
+	if (cost > split)
+	    split = cost;
+	cost = lcd_plan(lcd, &lcd->plan[i], &shadow[i*cells],
+			&lcd->data[i*cells], ac, cursor);
+	if (cost > rest)
+	    rest = cost;
+    }
+    if (joint+rest > split)
+	return 0;
+
+    lcd->stats.cost += joint;
+    lcd_plan_mode(lcd);
+    lcd_select_all(lcd);
+    lcd_plan_exec(lcd, &lcd->shared_plan, new);
+    memcpy(lcd->shadow, shadow, lcd->cells);
+    return 1;
 }
 
-static void lcd_scroll_up(void)
+void lcd_flush(struct lcd_device *lcd)
 {
-    memmove(&lcd_data[0], &lcd_data[LCD_COLS], (LCD_ROWS-1)*LCD_COLS);
-    memset(&lcd_data[(LCD_ROWS-1)*LCD_COLS], ' ', LCD_COLS);
-    lcd_redraw();
+    int cursor_chip = lcd->row/lcd->chip_rows;
+    int cursor, ac, i, dirty = 0;
+    const char *old, *new;
+
+    if (lcd->nchips > 1)
+	dirty = lcd_flush_shared(lcd, cursor_chip);
+    for (i = 0; i < lcd->nchips; i++) {
+	old = &lcd->shadow[i*lcd->chip_cells];
+	new = &lcd->data[i*lcd->chip_cells];
+	cursor = i == cursor_chip ? lcd_cell_addr(lcd, lcd->col, lcd->row)
+				  : -1;
+	ac = lcd_chip_ac(&lcd->chips[i]);
+	lcd->plan[i].n = 0;
+	if (!memcmp(old, new, lcd->chip_cells) && (cursor < 0 || ac == cursor))
+	    continue;
+	lcd->stats.cost += lcd_plan(lcd, &lcd->plan[i], old, new, ac, cursor);
+	dirty = 1;
+    }
+    if (dirty) {
+	lcd->stats.cost_redraw += lcd->rows*lcd_cost(lcd)->addr +
+				lcd->cells*lcd_cost(lcd)->write;
+	lcd_plan_mode(lcd);
+	if (lcd->nchips == 1)
+	    lcd_plan_exec(lcd, &lcd->plan[0], lcd->data);
+	else
+	    lcd_plan_exec_chips(lcd);
+	memcpy(lcd->shadow, lcd->data, lcd->cells);
+    }
+    lcd_select(lcd, cursor_chip);
+    lcd_move_cursor(lcd);
 }
-#endif /* SCROLL_REDRAW */
 
-#ifdef SCROLL_SHIFT
-static int lcd_current_shift = 0;
+    /*
+     *  Forget what the LCD contains and rewrite everything
+     */
 
-static void lcd_scroll_up(void)
+void lcd_redraw(struct lcd_device *lcd)
 {
-    int dir, exor, i;
+    int i;
 
-    if (lcd_current_shift == 0) {
-	dir = LCD_SHIFT_LEFT;
-	exor = 0;
-	lcd_current_shift = 20;
-    } else {
-	dir = LCD_SHIFT_RIGHT;
-	exor = 2;
-	lcd_current_shift = 0;
-    }
-    for (i = 0; i < LCD_COLS; i++)
-	lcd_shift(LCD_SHIFT_DISP, dir);
-    lcd_ddram(lcd_row_offset[exor]);
-    for (i = 0; i < LCD_COLS; i++)
-	lcd_write(' ');
-    lcd_ddram(lcd_row_offset[1 ^ exor]);
-    for (i = 0; i < LCD_COLS; i++)
-	lcd_write(' ');
-    lcd_ddram(lcd_row_offset[lcd_row ^ exor]+lcd_col);
-}
-#endif /* SCROLL_SHIFT */
+    for (i = 0; i < lcd->cells; i++)
+	lcd->shadow[i] = ~lcd->data[i];
+    lcd_flush(lcd);
+}
+
+static void lcd_scroll_up(struct lcd_device *lcd)
+{
+    memmove(&lcd->data[0], &lcd->data[lcd->cols], lcd->cells-lcd->cols);
+    memset(&lcd->data[lcd->cells-lcd->cols], ' ', lcd->cols);
+}
 
 #ifdef __KERNEL__
 static void lcd_blank(unsigned long data)
 {
-    lcd_backlight(0);
+    lcd_backlight((struct lcd_device *)data, 0);
 }
 
-static struct timer_list timer = {
-    function:	lcd_blank
-};
-
 #define LCD_BLANK_TIMEOUT	(60*HZ)
 
-static void lcd_kick(void)
+static void lcd_kick(struct lcd_device *lcd)
 {
-    if (!timer_pending(&timer))
-	lcd_backlight(1);
-    mod_timer(&timer, jiffies+LCD_BLANK_TIMEOUT);
+    if (!timer_pending(&lcd->blank_timer))
+	lcd_backlight(lcd, 1);
+    mod_timer(&lcd->blank_timer, jiffies+LCD_BLANK_TIMEOUT);
 }
 #endif /* !__KERNEL__ */
 
-#ifdef SCROLL_REDRAW
-void lcd_putc(char c)
-{
-#ifdef __KERNEL__
-    lcd_kick();
-#endif /* !__KERNEL__ */
+    /*
+     *  Update data only, the caller must call lcd_flush()
+     */
 
+static void lcd_text_putc(struct lcd_device *lcd, char c)
+{
     if (c == '\n') {
-	lcd_col = 0;
-	lcd_row++;
+	lcd->col = 0;
+	lcd->row++;
     } else {
-	lcd_write(c);
-	lcd_data[lcd_row*LCD_COLS+lcd_col++] = c;
-	if (lcd_col == LCD_COLS) {
-	    lcd_col = 0;
-	    lcd_row++;
+	lcd->data[lcd->row*lcd->cols+lcd->col++] = c;
+	if (lcd->col == lcd->cols) {
+	    lcd->col = 0;
+	    lcd->row++;
 	}
     }
-    if (lcd_row == LCD_ROWS) {
-	lcd_scroll_up();
-	lcd_row--;
+    if (lcd->row == lcd->rows) {
+	lcd_scroll_up(lcd);
+	lcd->row--;
     }
-    if (lcd_col == 0)
-	lcd_ddram(lcd_row_offset[lcd_row]);
 }
-#endif /* SCROLL_REDRAW */
 
-#ifdef SCROLL_SHIFT
-void lcd_putc(char c)
+void lcd_putc(struct lcd_device *lcd, char c)
 {
 #ifdef __KERNEL__
-    lcd_kick();
+    lcd_kick(lcd);
 #endif /* !__KERNEL__ */
 
-    if (c == '\n') {
-	lcd_col = 0;
-	lcd_row++;
-    } else {
-	lcd_write(c);
-	if (++lcd_col == LCD_COLS) {
-	    lcd_col = 0;
-	    lcd_row++;
-	}
-    }
-    if (lcd_row == LCD_ROWS) {
-	lcd_scroll_up();
-	lcd_row -= 2;
-    }
-    if (lcd_col == 0)
-	lcd_ddram(lcd_row_offset[lcd_row ^ (lcd_current_shift == 0 ? 0 : 2)]);
+    lcd_text_putc(lcd, c);
+    lcd_flush(lcd);
 }
-#endif /* SCROLL_SHIFT */
 
-void lcd_puts(const char *s)
+void lcd_puts(struct lcd_device *lcd, const char *s)
 {
     char c;
 
+#ifdef __KERNEL__
+    lcd_kick(lcd);
+#endif /* !__KERNEL__ */
+
     while ((c = *s++))
-	lcd_putc(c);
+	lcd_text_putc(lcd, c);
+    lcd_flush(lcd);
 }
 
-void lcd_printf(const char *fmt, ...)
+void lcd_printf(struct lcd_device *lcd, const char *fmt, ...)
 {
-    static char buf[1024];
     va_list args;
 
     va_start(args, fmt);
-    vsprintf(buf, fmt, args);
+    vsprintf(lcd->printf_buf, fmt, args);
     va_end(args);
-    lcd_puts(buf);
+    lcd_puts(lcd, lcd->printf_buf);
+}
+
+
+    /*
+     *  Asynchronous Console Log
+     *
+     *  lcd_log_write() appends text to a lockless ring buffer and never
+     *  touches the bus, so it's safe to call from printk(). lcd_log_drain()
+     *  later feeds everything to the text layer and flushes once, so a burst
+     *  of messages costs at most one screen update.
+     *
+     *  Lines may start with a printk-style "<N>" loglevel. Lines with a level
+     *  not below the display's log level are dropped. Kernel messages arrive
+     *  without it, printk() has filtered them already. If a line doesn't fit
+     *  in the buffer, the rest of it is dropped, but room is always kept for
+     *  its newline, so the next line doesn't continue the truncated one.
+     *
+     *  There must be only one writer (printk() serializes console drivers)
+     *  and one drainer at a time per display.
+     */
+
+#define LCD_LOG_DEFAULT_LEVEL	4	/* Like default_message_loglevel */
+
+int lcd_log_set_level(struct lcd_device *lcd, int level)
+{
+    int old = lcd->log_level;
+
+    lcd->log_level = level;
+    return old;
+}
+
+void lcd_log_write(struct lcd_device *lcd, const char *s, unsigned int count)
+{
+    unsigned int head = lcd->log_head;
+    int level;
+    char c;
+
+    while (count--) {
+	c = *s++;
+	if (lcd->log_bol) {
+	    lcd->log_bol = 0;
+	    level = LCD_LOG_DEFAULT_LEVEL;
+	    if (c == '<' && count >= 2 && s[0] >= '0' && s[0] <= '7' &&
+		s[1] == '>') {
+		level = s[0]-'0';
+		s += 2;
+		count -= 2;
+		if (!count--)
+		    break;
+		c = *s++;
+	    }
+	    lcd->log_skip = level >= lcd->log_level;
+	}
+	if (c == '\n')
+	    lcd->log_bol = 1;
+	if (lcd->log_skip) {
+	    lcd->stats.log_filtered++;
+	} else if ((lcd->log_overflow && c != '\n') ||
+		   LCD_LOG_SIZE-(head-lcd->log_tail) < (c == '\n' ? 1 : 2)) {
+	    lcd->stats.log_dropped++;
+	    lcd->log_overflow = 1;
+	} else {
+	    lcd->log_buf[head++ & (LCD_LOG_SIZE-1)] = c;
+	    lcd->stats.log++;
+	}
+	if (lcd->log_bol)
+	    lcd->log_skip = lcd->log_overflow = 0;
+    }
+    lcd_mb();
+    lcd->log_head = head;
+}
+
+unsigned int lcd_log_drain(struct lcd_device *lcd)
+{
+    unsigned int head = lcd->log_head, tail = lcd->log_tail, n = head-tail;
+
+    if (!n)
+	return 0;
+    lcd_mb();
+    while (tail != head)
+	lcd_text_putc(lcd, lcd->log_buf[tail++ & (LCD_LOG_SIZE-1)]);
+    lcd_mb();
+    lcd->log_tail = tail;
+    lcd_flush(lcd);
+    return n;
+}
+
+#ifdef __KERNEL__
+    /*
+     *  Drain from keventd, a bit later to coalesce bursts
+     */
+
+#define LCD_LOG_DELAY		(HZ/20)
+
+static void lcd_log_task_func(void *data)
+{
+    struct lcd_device *lcd = data;
+
+    lcd_kick(lcd);
+    lcd_log_drain(lcd);
+}
+
+static void lcd_log_timer_func(unsigned long data)
+{
+    schedule_task(&((struct lcd_device *)data)->log_task);
+}
+
+static void lcd_log_kick(struct lcd_device *lcd)
+{
+    if (!timer_pending(&lcd->log_timer))
+	mod_timer(&lcd->log_timer, jiffies+LCD_LOG_DELAY);
+}
+
+static void lcd_kernel_init(struct lcd_device *lcd)
+{
+    init_timer(&lcd->blank_timer);
+    lcd->blank_timer.function = lcd_blank;
+    lcd->blank_timer.data = (unsigned long)lcd;
+    init_timer(&lcd->log_timer);
+    lcd->log_timer.function = lcd_log_timer_func;
+    lcd->log_timer.data = (unsigned long)lcd;
+    INIT_TQUEUE(&lcd->log_task, lcd_log_task_func, lcd);
 }
 
+static void lcd_kernel_cleanup(struct lcd_device *lcd)
+{
+    del_timer_sync(&lcd->log_timer);
+    flush_scheduled_tasks();
+    del_timer_sync(&lcd->blank_timer);
+}
+#endif /* __KERNEL__ */
+
 #ifdef MODULE
 int init_module(void)
 {
@@ -493,6 +2088,5 @@ int init_module(void)
 
 void cleanup_module(void)
 {
-    del_timer(&timer);
 }
 #endif /* MODULE */
@@ -7,24 +7,87 @@
  */
 
 
+#ifndef _HD44780_H
+#define _HD44780_H
+
     /*
      *  Physical LCD Interface
      */
 
+    /*
+     *  Relative cost of LCD operations, used by the update planner
+     */
+
+struct lcd_cost {
+    unsigned int write;		/* Write one data byte */
+    unsigned int addr;		/* Set DDRAM address */
+    unsigned int clr;		/* Clear display */
+};
+
+    /*
+     *  Drivers only transfer data, pacing is done by the mid-level layer.
+     *  Displays with two controllers have an E line per controller, E pulses
+     *  go to the ones in the device's e_mask.
+     */
+
+struct lcd_device;
+struct lcd_seq;
+
 struct lcd_driver {
     /* High-level Interface (may be NULL) */
-    void (*write)(u8 val, int rs);
-    u8 (*read)(int rs);
+    void (*write)(struct lcd_device *lcd, u8 val, int rs);
+    u8 (*read)(struct lcd_device *lcd, int rs);
+    void (*write_vec)(struct lcd_device *lcd, const u8 *buf, unsigned int n,
+		      int rs);
+    /* Compiled Sequences (may be NULL) */
+    void (*run_seq)(struct lcd_device *lcd, const struct lcd_seq *seq);
     /* Low-level Interface */
-    void (*set_rs_rw)(int rs, int rw);
-    void (*set_e)(int e);
-    void (*set_bl)(int bl);
-    void (*set_data)(u8 val);
-    u8 (*get_data)(void);
+    void (*set_rs_rw)(struct lcd_device *lcd, int rs, int rw);
+    void (*set_e)(struct lcd_device *lcd, int e);
+    void (*set_bl)(struct lcd_device *lcd, int bl);
+    void (*set_data)(struct lcd_device *lcd, u8 val);
+    u8 (*get_data)(struct lcd_device *lcd);
+    /* Cost Model (may be NULL) */
+    const struct lcd_cost *cost;
 };
 
-extern void lcd_register_driver(const struct lcd_driver *driver);
-extern void lcd_unregister_driver(const struct lcd_driver *driver);
+extern void lcd_register_driver(struct lcd_device *lcd,
+				const struct lcd_driver *driver, void *priv);
+extern void lcd_unregister_driver(struct lcd_device *lcd,
+				  const struct lcd_driver *driver);
+
+    /*
+     *  Helpers for the high-level interface: the width of the next transfer
+     *  (4-bit mode is entered using a 8-bit transfer), the delay for signal
+     *  setup and the E pulse width, and lcd_wait_write(), which write_vec()
+     *  has to call between bytes to pace them against their deadlines
+     */
+
+extern int lcd_bus_width(struct lcd_device *lcd);
+extern void lcd_delay_strobe(struct lcd_device *lcd);
+extern void lcd_wait_write(struct lcd_device *lcd);
+extern void lcd_ndelay(struct lcd_device *lcd, unsigned long nsecs);
+
+
+/* ------------------------------------------------------------------------- */
+
+
+    /*
+     *  Statistics
+     */
+
+struct lcd_stats {
+    unsigned long write, read;		/* Bus transfers */
+    unsigned long poll, timeout;	/* Busy flag polling */
+    unsigned long elided;		/* Skipped redundant commands */
+    unsigned long io;			/* Port accesses, counted by drivers */
+    unsigned long cost, cost_redraw;	/* Update planner */
+    unsigned long log, log_filtered, log_dropped;
+    unsigned long overlap_us;		/* Execution time not waited for */
+    unsigned long broadcast;		/* E cycles saved by broadcasting */
+    unsigned long long delay_ns;	/* Time spent in delays */
+    unsigned long long sleep_ns;	/* Part of it spent asleep */
+};
 
 
 /* ------------------------------------------------------------------------- */
@@ -34,8 +97,115 @@ extern void lcd_unregister_driver(const struct lcd_driver *driver);
      *  Mid-Level LCD Access
      */
 
-extern void __lcd_write(u8 val, int rs);
-extern u8 __lcd_read(int rs);
+extern void __lcd_write(struct lcd_device *lcd, u8 val, int rs);
+extern void __lcd_write_vec(struct lcd_device *lcd, const u8 *buf,
+			    unsigned int n, int rs);
+extern u8 __lcd_read(struct lcd_device *lcd, int rs);
+
+
+    /*
+     *  Write Pacing
+     *
+     *  LCD_PACING_DELAY waits for the worst-case execution time after each
+     *  transfer, LCD_PACING_BUSY polls the busy flag instead. The latter needs
+     *  a connected RW line and a bidirectional data bus, and falls back to
+     *  LCD_PACING_DELAY if the LCD stays busy for too long.
+     */
+
+#define LCD_PACING_DELAY	(0)
+#define LCD_PACING_BUSY		(1)
+
+extern int lcd_set_pacing(struct lcd_device *lcd, int pacing);
+extern void lcd_sync(struct lcd_device *lcd);
+
+#ifndef __KERNEL__
+
+    /*
+     *  Clock and Delay Backend
+     *
+     *  All timing goes through the selected clock. lcd_clock_real waits for
+     *  real, lcd_clock_virtual just advances a simulated clock. The clock is
+     *  shared by all displays, select it before starting any threads.
+     */
+
+struct lcd_clock {
+    const char *name;
+    unsigned long long (*now_ns)(void);
+    void (*delay_ns)(unsigned long long nsecs);
+};
+
+extern const struct lcd_clock lcd_clock_real, lcd_clock_virtual;
+
+extern const struct lcd_clock *lcd_set_clock(const struct lcd_clock *clock);
+extern const struct lcd_clock *lcd_get_clock(void);
+extern unsigned long long lcd_clock_ns(void);
+extern int lcd_use_tsc(const char *file);
+extern unsigned long lcd_set_spin_threshold(unsigned long usecs);
+extern void lcd_udelay(unsigned long usecs);
+
+#endif /* !__KERNEL__ */
+
+
+/* ------------------------------------------------------------------------- */
+
+
+    /*
+     *  Compiled Sequences
+     *
+     *  A sequence of raw LCD operations (commands, lcd_ddram(), lcd_write(),
+     *  ...) issued between lcd_seq_begin() and lcd_seq_end() is not sent to
+     *  the LCD, but recorded as a flat list of port writes and delays, which
+     *  lcd_seq_run() replays in one go. Each data byte written is a slot that
+     *  can be changed using lcd_seq_patch() before replaying. The text layer
+     *  doesn't know about sequences, so don't use it while recording. After
+     *  a replay, lcd_flush() rewrites the cells the sequence wrote to (all of
+     *  its controller's, if it clears or shifts the display, or writes data
+     *  before setting the address).
+     *
+     *  While recording (seq_recording is set), drivers pass their port writes
+     *  to lcd_seq_out() instead, with data set if the value is on the LCD's
+     *  data lines.
+     */
+
+#define LCD_SEQ_OUT		0	/* Write val to port arg */
+#define LCD_SEQ_DELAY		1	/* Wait arg ns */
+
+#define LCD_SEQ_BYTE		1	/* val carries a data byte */
+#define LCD_SEQ_HIGH		2	/* val carries its high nibble */
+#define LCD_SEQ_LOW		3	/* val carries its low nibble */
+
+#define LCD_SEQ_MAX		2048
+#define LCD_SEQ_SLOTS		160
+#define LCD_SEQ_PORTS		4
+#define LCD_SEQ_CELLS		80	/* Per controller, LCD_DDRAM_CELLS */
+
+struct lcd_step {
+    u8 op;			/* LCD_SEQ_OUT or LCD_SEQ_DELAY */
+    u8 val;
+    u8 data;			/* LCD_SEQ_BYTE/HIGH/LOW, or 0 */
+    unsigned int arg;		/* Port number or delay in ns */
+};
+
+struct lcd_seq {
+    unsigned int n, slots;
+    unsigned int writes;	/* LCD transfers */
+    unsigned int pending;	/* Execution time of the last one (us) */
+    int width;
+    int overflow;
+    int chip;			/* The controller it was recorded for */
+    int last[LCD_SEQ_PORTS];	/* Last step writing each port, or -1 */
+    int regs[6];		/* Controller state at the end */
+    u8 written[LCD_SEQ_CELLS];	/* Text layer cells it writes to */
+    struct lcd_step step[LCD_SEQ_MAX];
+    unsigned short slot[LCD_SEQ_SLOTS];	/* First step of each data byte */
+};
+
+extern int lcd_seq_begin(struct lcd_device *lcd, struct lcd_seq *seq);
+extern int lcd_seq_end(struct lcd_device *lcd, struct lcd_seq *seq);
+extern void lcd_seq_patch(struct lcd_seq *seq, unsigned int slot, u8 val);
+extern int lcd_seq_run(struct lcd_device *lcd, const struct lcd_seq *seq);
+extern void lcd_seq_out(struct lcd_device *lcd, unsigned int port, u8 val,
+			int data);
 
 
 /* ------------------------------------------------------------------------- */
@@ -45,16 +215,30 @@ extern u8 __lcd_read(int rs);
      *  High-Level LCD Access
      */
 
-extern void lcd_init(int width);
-extern void lcd_cleanup(void);
+extern void lcd_init(struct lcd_device *lcd, int width);
+extern void lcd_cleanup(struct lcd_device *lcd);
 
 
     /*
      *  LCD Commands
+     *
+     *  lcd_mode(), lcd_ctrl(), lcd_func(), lcd_cgram() and lcd_ddram() are
+     *  skipped if they would not change the controller's state. Call
+     *  lcd_invalidate() after changing that state behind our back (e.g. raw
+     *  commands, or a power cycle).
      */
 
-static inline void lcd_write_cmd(u8 cmd) { __lcd_write(cmd, 0); }
-static inline u8 lcd_read_cmd(void) { return __lcd_read(0); }
+extern void lcd_invalidate(struct lcd_device *lcd);
+
+static inline void lcd_write_cmd(struct lcd_device *lcd, u8 cmd)
+{
+    __lcd_write(lcd, cmd, 0);
+}
+
+static inline u8 lcd_read_cmd(struct lcd_device *lcd)
+{
+    return __lcd_read(lcd, 0);
+}
 
 
 #define LCD_CMD_CLR	(1)
@@ -71,14 +255,14 @@ static inline u8 lcd_read_cmd(void) { return __lcd_read(0); }
      *  Clear Display
      */
 
-extern void lcd_clr(void);
+extern void lcd_clr(struct lcd_device *lcd);
 
 
     /*
      *  Return Home
      */
 
-extern void lcd_home(void);
+extern void lcd_home(struct lcd_device *lcd);
 
 
     /*
@@ -90,10 +274,7 @@ extern void lcd_home(void);
 #define LCD_SHIFT_ON	(1)
 #define LCD_SHIFT_OFF	(0)
 
-static inline void lcd_mode(int inc, int shift)
-{
-    lcd_write_cmd(LCD_CMD_MODE | inc | shift);
-}
+extern void lcd_mode(struct lcd_device *lcd, int inc, int shift);
 
 
     /*
@@ -109,10 +290,8 @@ static inline void lcd_mode(int inc, int shift)
 #define LCD_BLINK_ON	(1)
 #define LCD_BLINK_OFF	(0)
 
-static inline void lcd_ctrl(int display, int cursor, int blink)
-{
-    lcd_write_cmd(LCD_CMD_CTRL | display | cursor | blink);
-}
+extern void lcd_ctrl(struct lcd_device *lcd, int display, int cursor,
+		     int blink);
 
 
     /*
@@ -125,9 +304,9 @@ static inline void lcd_ctrl(int display, int cursor, int blink)
 #define LCD_SHIFT_RIGHT	(4)
 #define LCD_SHIFT_LEFT	(0)
 
-static inline void lcd_shift(int display, int right)
+static inline void lcd_shift(struct lcd_device *lcd, int display, int right)
 {
-    lcd_write_cmd(LCD_CMD_SHIFT | display | right);
+    lcd_write_cmd(lcd, LCD_CMD_SHIFT | display | right);
 }
 
 
@@ -144,10 +323,8 @@ static inline void lcd_shift(int display, int right)
 #define LCD_FONT_5x10	(4)
 #define LCD_FONT_5x8	(0)
 
-static inline void lcd_func(int datalen, int lines, int font)
-{
-    lcd_write_cmd(LCD_CMD_FUNC | datalen | lines | font);
-}
+extern void lcd_func(struct lcd_device *lcd, int datalen, int lines,
+		     int font);
 
 
     /*
@@ -156,10 +333,7 @@ static inline void lcd_func(int datalen, int lines, int font)
 
 #define LCD_CGRAM_MASK	(63)
 
-static inline void lcd_cgram(u8 a)
-{
-    lcd_write_cmd(LCD_CMD_CGRAM | (a & LCD_CGRAM_MASK));
-}
+extern void lcd_cgram(struct lcd_device *lcd, u8 a);
 
 
     /*
@@ -168,10 +342,7 @@ static inline void lcd_cgram(u8 a)
 
 #define LCD_DDRAM_MASK	(127)
 
-static inline void lcd_ddram(u8 a)
-{
-    lcd_write_cmd(LCD_CMD_DDRAM | (a & LCD_DDRAM_MASK));
-}
+extern void lcd_ddram(struct lcd_device *lcd, u8 a);
 
 
     /*
@@ -181,44 +352,220 @@ static inline void lcd_ddram(u8 a)
 #define LCD_BUSY	(128)
 #define LCD_ADDR_MASK	(127)
 
-extern int lcd_is_busy(u8 *addr);
+extern int lcd_is_busy(struct lcd_device *lcd, u8 *addr);
 
 
     /*
      *  Write Data to CG or DDRAM
      */
 
-static inline void lcd_write(u8 val) { __lcd_write(val, 1); }
+static inline void lcd_write(struct lcd_device *lcd, u8 val)
+{
+    __lcd_write(lcd, val, 1);
+}
+
+static inline void lcd_write_vec(struct lcd_device *lcd, const u8 *buf,
+				 unsigned int n)
+{
+    __lcd_write_vec(lcd, buf, n, 1);
+}
 
 
     /*
      *  Read Data from CG or DDRAM
      */
 
-static inline u8 lcd_read(void) { return __lcd_read(1); }
+static inline u8 lcd_read(struct lcd_device *lcd)
+{
+    return __lcd_read(lcd, 1);
+}
 
 
     /*
      *  Backlight Control
      */
 
-extern void lcd_backlight(int light);
+extern void lcd_backlight(struct lcd_device *lcd, int light);
 
 
     /*
-     *  Device-Specific Initialization for a 20x4 LCD
+     *  Device-Specific Initialization
+     *
+     *  The geometry can be changed before lcd_init(). Displays with 1 row use
+     *  1-line mode and up to 80 columns, displays with 2 rows use 2-line mode
+     *  and up to 40 columns, and displays with 4 rows continue rows 0 and 1 in
+     *  rows 2 and 3, using up to 20 columns. Wider 4-row displays have a
+     *  second controller for rows 2 and 3, with its own E line.
+     *
+     *  Commands and data go to the selected controller. lcd_goto() selects
+     *  the one showing the cell, lcd_select() selects one by number, and
+     *  lcd_select_all() all of them, so content they share (e.g. CGRAM
+     *  glyphs) is strobed into all of them at once. lcd_init(), lcd_clr(),
+     *  lcd_home() and lcd_ctrl() handle all of them, only the selected one
+     *  shows the cursor. lcd_flush() broadcasts changes that are the same on
+     *  all of them, if that is no slower.
      */
 
-extern void lcd_init(int width);
-extern void lcd_cleanup(void);
+#define LCD_DEFAULT_COLS	20
+#define LCD_DEFAULT_ROWS	4
+
+extern int lcd_set_geometry(struct lcd_device *lcd, int cols, int rows);
+extern void lcd_goto(struct lcd_device *lcd, int x, int y);
+extern void lcd_select(struct lcd_device *lcd, int chip);
+extern void lcd_select_all(struct lcd_device *lcd);
 
 
     /*
      *  LCD Text Support
      */
 
-extern void lcd_putc(char c);
-extern void lcd_puts(const char *s);
-extern void lcd_printf(const char *fmt, ...)
-    __attribute__ ((format (printf, 1, 2)));
+#define LCD_PRINTF_MAX	1024
+
+extern void lcd_putc(struct lcd_device *lcd, char c);
+extern void lcd_puts(struct lcd_device *lcd, const char *s);
+extern void lcd_printf(struct lcd_device *lcd, const char *fmt, ...)
+    __attribute__ ((format (printf, 2, 3)));
+extern void lcd_flush(struct lcd_device *lcd);
+extern void lcd_redraw(struct lcd_device *lcd);
+
+
+    /*
+     *  Asynchronous Console Log
+     */
+
+#define LCD_LOG_SIZE	4096		/* Must be a power of two */
+
+extern int lcd_log_set_level(struct lcd_device *lcd, int level);
+extern void lcd_log_write(struct lcd_device *lcd, const char *s,
+			  unsigned int count);
+extern unsigned int lcd_log_drain(struct lcd_device *lcd);
+
+
+    /*
+     *  Update Planner
+     *
+     *  lcd_plan() computes the cheapest sequence of DDRAM address sets, data
+     *  writes and an optional clear that turns the screen contents old (NULL
+     *  means blank) into new, starting with the address counter at ac (-1 if
+     *  unknown) and ending with it at cursor (-1 for anywhere). Both screens
+     *  are the cells of a single controller. It returns the cost of the plan.
+     */
+
+#define LCD_DDRAM_CELLS	(80)		/* 2 lines of 40 characters */
+#define LCD_CHIPS_MAX	(2)
+#define LCD_CELLS_MAX	(LCD_CHIPS_MAX*LCD_DDRAM_CELLS)
+
+#define LCD_OP_CLR	(0)
+#define LCD_OP_ADDR	(1)		/* Set DDRAM address to addr */
+#define LCD_OP_DATA	(2)		/* Write len cells, starting at addr */
+
+struct lcd_op {
+    u8 type;
+    u8 addr;
+    u8 len;
+};
+
+#define LCD_PLAN_MAX	(2*LCD_DDRAM_CELLS+4)
+
+struct lcd_plan {
+    unsigned int n;
+    unsigned int cost;
+    struct lcd_op op[LCD_PLAN_MAX];
+};
+
+extern unsigned int lcd_plan(struct lcd_device *lcd, struct lcd_plan *plan,
+			     const char *old, const char *new, int ac,
+			     int cursor);
+extern void lcd_plan_exec(struct lcd_device *lcd, const struct lcd_plan *plan,
+			  const char *new);
+
+
+/* ------------------------------------------------------------------------- */
+
+
+    /*
+     *  Controller State
+     *
+     *  We follow all transfers to know the contents of the controller's
+     *  registers, and when it will be ready for the next transfer
+     */
+
+struct lcd_chip {
+    int ac;				/* Address counter, -1 if unknown */
+    int ac_cgram;			/* Address counter points into CGRAM */
+    int ac_inc;				/* Entry mode increments */
+    int reg_mode, reg_ctrl, reg_func;
+    unsigned long ready_at;		/* Deadline in us */
+    unsigned int pending;		/* Execution time of pending operation */
+};
+
+    /*
+     *  LCD Device
+     *
+     *  All state of a display, so several of them can be driven at once, each
+     *  from its own thread if needed. Nothing is shared between displays but
+     *  the (read-only) clock selection, so no locking is done. Drivers keep
+     *  their instance data in priv.
+     */
+
+struct lcd_device {
+    const struct lcd_driver *driver;
+    void *priv;
+    int width;				/* Current bus width */
+    /* Controllers */
+    struct lcd_chip chips[LCD_CHIPS_MAX];
+    struct lcd_chip *chip;		/* The selected one */
+    unsigned int e_mask;		/* Its E line */
+    int ctrl;				/* Display control, see lcd_ctrl() */
+    /* Write pacing */
+    int pacing;
+    /* Compiled sequences */
+    struct lcd_seq *seq_recording;
+    int seq_regs[6];			/* Controller state while recording */
+    int seq_pacing;
+    /* Geometry, and address tables built from it */
+    int cols, rows, cells;
+    int nchips, chip_rows, chip_cells;	/* Per controller */
+    int lines;				/* LCD_LINES_1 or LCD_LINES_2 */
+    u8 cell_addr[LCD_CELLS_MAX];	/* In the cell's controller */
+    short addr_cell[LCD_DDRAM_MASK+1];	/* Controller cell, or -1 */
+    u8 addr_pos[LCD_DDRAM_MASK+1];	/* Position in AC order */
+    u8 addr_next[LCD_DDRAM_MASK+1], addr_prev[LCD_DDRAM_MASK+1];
+    u8 cell_order[LCD_DDRAM_CELLS];	/* Controller cells in AC order */
+    u8 pos_order[LCD_DDRAM_CELLS];	/* Next cell_order index from pos */
+    /* Text */
+    int col, row;
+    char data[LCD_CELLS_MAX];		/* What we want to show */
+    char shadow[LCD_CELLS_MAX];		/* What the LCD contains */
+    struct lcd_plan plan[LCD_CHIPS_MAX];
+    struct lcd_plan shared_plan;	/* Broadcast to all controllers */
+    char printf_buf[LCD_PRINTF_MAX];
+    /* Console log */
+    char log_buf[LCD_LOG_SIZE];
+    volatile unsigned int log_head, log_tail;
+    int log_level;
+    int log_bol;			/* At beginning of line */
+    int log_skip;			/* Dropping the current line */
+    int log_overflow;			/* Dropping the rest of the line */
+#ifdef __KERNEL__
+    struct timer_list blank_timer, log_timer;
+    struct tq_struct log_task;
+#else
+    unsigned long long start_ns, start_cpu_ns, start_clock_ns;
+    unsigned long long clock_ns;	/* Virtual time it was last used */
+#endif
+    struct lcd_stats stats;
+};
+
+#define LCD_POS_NONE	(0xff)		/* addr_pos of an invalid address */
+
+static inline u8 lcd_cell_addr(struct lcd_device *lcd, int x, int y)
+{
+    return lcd->cell_addr[y*lcd->cols+x];
+}
+
+#ifdef __KERNEL__
+extern struct lcd_device *lcd_console_dev;
+#endif
 
+#endif /* _HD44780_H */
@@ -14,6 +14,8 @@
 #include <linux/console.h>
 #include <linux/string.h>
 #include <linux/vt_kern.h>
+#include <linux/timer.h>
+#include <linux/tqueue.h>
 
 #include "hd44780.h"
 
@@ -23,54 +25,239 @@ static const char *lcdcon_startup(void)
 }
 
 
-// FIXME
-// Alternative using a 20x4 window on a 80x25 virtual screen?
+    /*
+     *  Virtual Screen
+     *
+     *  The console is a virtual screen of lcdcon_cols x lcdcon_rows (80x25 by
+     *  default), kept in lcdcon_data. The LCD shows a viewport onto it, which
+     *  follows the cursor, unless it was panned explicitly (Shift-PageUp/Down
+     *  or lcdcon_pan()).
+     *
+     *  Changes outside the viewport only touch memory.
+     */
 
-#define LCD_COLS	20
-#define LCD_ROWS	4
+#define LCDCON_COLS	80
+#define LCDCON_ROWS	25
 
-static char lcdcon_data[LCD_COLS*LCD_ROWS];
-static const unsigned int lcdcon_row_offset[LCD_ROWS] = { 0, 64, 20, 84 };
+static int lcdcon_cols = LCDCON_COLS;
+static int lcdcon_rows = LCDCON_ROWS;
+
+MODULE_PARM(lcdcon_cols, "i");
+MODULE_PARM(lcdcon_rows, "i");
+
+static struct lcd_device *lcdcon_lcd;
+
+static u8 lcdcon_data[LCDCON_COLS*LCDCON_ROWS];
 
 static int lcdcon_cursor_shown = 1;
-static unsigned int lcdcon_cur_x = 0, lcdcon_cur_y = 0;
+static int lcdcon_cursor_on_lcd = 1;	/* As of the last flush */
+static int lcdcon_cur_x = 0, lcdcon_cur_y = 0;
+
+static int lcdcon_view_x = 0, lcdcon_view_y = 0;
+static int lcdcon_following = 1;
 
-static inline void lcdcon_goto(unsigned int x, unsigned int y)
+static inline int lcdcon_visible(int sx, int sy, int width, int height)
 {
-    lcd_ddram(lcdcon_row_offset[y]+x);
+    return sx < lcdcon_view_x+lcdcon_lcd->cols && sx+width > lcdcon_view_x &&
+	   sy < lcdcon_view_y+lcdcon_lcd->rows && sy+height > lcdcon_view_y;
 }
 
-static inline void lcdcon_goto_cursor(void)
+static inline int lcdcon_cursor_visible(void)
 {
-    if (lcdcon_cursor_shown)
-	lcdcon_goto(lcdcon_cur_x, lcdcon_cur_y);
+    return lcdcon_cursor_shown &&
+	   lcdcon_visible(lcdcon_cur_x, lcdcon_cur_y, 1, 1);
 }
 
-static void lcdcon_write_vec(const char *data, unsigned int n)
+    /*
+     *  Deferred Flush
+     *
+     *  The VT layer calls the console operations in bursts. They only update
+     *  lcdcon_data and record which part of the viewport became dirty. A bit
+     *  later, keventd copies the dirty part into lcd->data and calls
+     *  lcd_flush() once for the whole burst, which writes only the cells that
+     *  differ from what the LCD shows and positions the cursor once.
+     */
+
+#define LCDCON_FLUSH_DELAY	(HZ/50)
+
+static struct timer_list lcdcon_flush_timer;
+static struct tq_struct lcdcon_flush_task;
+
+/* Dirty part of the viewport, in viewport coordinates, empty if x0 == x1 */
+static int lcdcon_dirty_x0, lcdcon_dirty_y0, lcdcon_dirty_x1, lcdcon_dirty_y1;
+static int lcdcon_cursor_dirty;
+
+static void lcdcon_kick(void)
 {
-    while (n--)
-	lcd_write(*data++);
+    if (!timer_pending(&lcdcon_flush_timer))
+	mod_timer(&lcdcon_flush_timer, jiffies+LCDCON_FLUSH_DELAY);
 }
 
-static void lcdcon_redraw_region(int sx, int sy, int width, int height)
+static void lcdcon_mark_dirty(int sx, int sy, int width, int height)
 {
-    int y;
+    int x0 = sx-lcdcon_view_x, y0 = sy-lcdcon_view_y;
+    int x1 = x0+width, y1 = y0+height;
+
+    if (x0 < 0)
+	x0 = 0;
+    if (y0 < 0)
+	y0 = 0;
+    if (x1 > lcdcon_lcd->cols)
+	x1 = lcdcon_lcd->cols;
+    if (y1 > lcdcon_lcd->rows)
+	y1 = lcdcon_lcd->rows;
+    if (x0 >= x1 || y0 >= y1)
+	return;
+    if (lcdcon_dirty_x0 == lcdcon_dirty_x1) {
+	lcdcon_dirty_x0 = x0;
+	lcdcon_dirty_y0 = y0;
+	lcdcon_dirty_x1 = x1;
+	lcdcon_dirty_y1 = y1;
+    } else {
+	if (x0 < lcdcon_dirty_x0)
+	    lcdcon_dirty_x0 = x0;
+	if (y0 < lcdcon_dirty_y0)
+	    lcdcon_dirty_y0 = y0;
+	if (x1 > lcdcon_dirty_x1)
+	    lcdcon_dirty_x1 = x1;
+	if (y1 > lcdcon_dirty_y1)
+	    lcdcon_dirty_y1 = y1;
+    }
+    lcdcon_kick();
+}
+
+static inline void lcdcon_mark_view(void)
+{
+    lcdcon_mark_dirty(lcdcon_view_x, lcdcon_view_y, lcdcon_lcd->cols,
+		      lcdcon_lcd->rows);
+}
 
-    for (y = sy; y < sy+height; y++) {
-	lcdcon_goto(sx, y);
-	lcdcon_write_vec(&lcdcon_data[y*LCD_COLS+sx], width);
+static inline void lcdcon_mark_cursor(void)
+{
+    lcdcon_cursor_dirty = 1;
+    lcdcon_kick();
+}
+
+    /*
+     *  The cursor moved, or was hidden or shown. Unless it is off the LCD
+     *  both before and after, the LCD must be updated.
+     */
+
+static inline void lcdcon_cursor_changed(void)
+{
+    if (lcdcon_cursor_visible() || lcdcon_cursor_on_lcd)
+	lcdcon_mark_cursor();
+}
+
+static void lcdcon_flush(void)
+{
+    struct lcd_device *lcd = lcdcon_lcd;
+    int y, width = lcdcon_dirty_x1-lcdcon_dirty_x0;
+
+    if (!width && !lcdcon_cursor_dirty)
+	return;
+    for (y = lcdcon_dirty_y0; width && y < lcdcon_dirty_y1; y++)
+	memcpy(&lcd->data[y*lcd->cols+lcdcon_dirty_x0],
+	       &lcdcon_data[(lcdcon_view_y+y)*lcdcon_cols+lcdcon_view_x+
+			    lcdcon_dirty_x0], width);
+    lcdcon_dirty_x0 = lcdcon_dirty_x1 = 0;
+    lcdcon_cursor_dirty = 0;
+    if (lcdcon_cursor_visible()) {
+	lcd->col = lcdcon_cur_x-lcdcon_view_x;
+	lcd->row = lcdcon_cur_y-lcdcon_view_y;
     }
-    lcdcon_goto_cursor();
+    lcd_flush(lcd);
+    lcdcon_cursor_on_lcd = lcdcon_cursor_visible();
+    if (lcdcon_cursor_on_lcd)
+	lcd_ctrl(lcd, LCD_DISP_ON, LCD_CURSOR_ON, LCD_BLINK_ON);
+    else
+	lcd_ctrl(lcd, LCD_DISP_ON, LCD_CURSOR_OFF, LCD_BLINK_OFF);
+}
+
+static void lcdcon_flush_task_func(void *data)
+{
+    acquire_console_sem();
+    lcdcon_flush();
+    release_console_sem();
 }
 
+static void lcdcon_flush_timer_func(unsigned long data)
+{
+    schedule_task(&lcdcon_flush_task);
+}
+
+    /*
+     *  Move the viewport, returns whether it moved
+     */
+
+static int lcdcon_move_view(int x, int y)
+{
+    if (x > lcdcon_cols-lcdcon_lcd->cols)
+	x = lcdcon_cols-lcdcon_lcd->cols;
+    if (x < 0)
+	x = 0;
+    if (y > lcdcon_rows-lcdcon_lcd->rows)
+	y = lcdcon_rows-lcdcon_lcd->rows;
+    if (y < 0)
+	y = 0;
+    if (x == lcdcon_view_x && y == lcdcon_view_y)
+	return 0;
+    lcdcon_view_x = x;
+    lcdcon_view_y = y;
+    return 1;
+}
+
+    /*
+     *  Move the viewport as little as needed to contain the cursor
+     */
+
+static int lcdcon_follow_cursor(void)
+{
+    int x = lcdcon_view_x, y = lcdcon_view_y;
+
+    if (lcdcon_cur_x < x)
+	x = lcdcon_cur_x;
+    else if (lcdcon_cur_x >= x+lcdcon_lcd->cols)
+	x = lcdcon_cur_x-lcdcon_lcd->cols+1;
+    if (lcdcon_cur_y < y)
+	y = lcdcon_cur_y;
+    else if (lcdcon_cur_y >= y+lcdcon_lcd->rows)
+	y = lcdcon_cur_y-lcdcon_lcd->rows+1;
+    return lcdcon_move_view(x, y);
+}
+
+    /*
+     *  Pan the viewport to (x, y), it stops following the cursor until
+     *  lcdcon_follow() is called
+     */
+
+void lcdcon_pan(int x, int y)
+{
+    lcdcon_following = 0;
+    if (lcdcon_move_view(x, y))
+	lcdcon_mark_view();
+}
+
+void lcdcon_follow(void)
+{
+    lcdcon_following = 1;
+    if (lcdcon_follow_cursor())
+	lcdcon_mark_view();
+}
+
+
+    /*
+     *  Console Operations
+     */
+
 static void lcdcon_init(struct vc_data *conp, int init)
 {
     conp->vc_can_do_color = 0;
     if (init) {
-	conp->vc_cols = LCD_COLS;
-	conp->vc_rows = LCD_ROWS;
+	conp->vc_cols = lcdcon_cols;
+	conp->vc_rows = lcdcon_rows;
     } else
-	vc_resize_con(LCD_ROWS, LCD_COLS, conp->vc_num);
+	vc_resize_con(lcdcon_rows, lcdcon_cols, conp->vc_num);
 }
 
 static void lcdcon_deinit(struct vc_data *conp)
@@ -82,35 +269,26 @@ static void lcdcon_clear(struct vc_data *conp, int sy, int sx, int height,
 {
     int y;
 
-    if (sy == 0 && sx == 0 && height == LCD_ROWS && width == LCD_COLS) {
-	lcd_clr();
-	memset(lcdcon_data, ' ', LCD_COLS*LCD_ROWS);
-    } else
-	for (y = sy; y < sy+height; y++) {
-	    lcdcon_goto(sx, y);
-	    memset(&lcdcon_data[y*LCD_COLS+sx], ' ', width);
-	    lcdcon_write_vec(&lcdcon_data[y*LCD_COLS+sx], width);
-	}
-    lcdcon_goto_cursor();
+    for (y = sy; y < sy+height; y++)
+	memset(&lcdcon_data[y*lcdcon_cols+sx], ' ', width);
+    lcdcon_mark_dirty(sx, sy, width, height);
 }
 
 static void lcdcon_putc(struct vc_data *conp, int c, int ypos, int xpos)
 {
-    lcdcon_goto(xpos, ypos);
-    lcd_write(c);
-    lcdcon_data[ypos*LCD_COLS+xpos] = c;
-    lcdcon_goto_cursor();
+    lcdcon_data[ypos*lcdcon_cols+xpos] = c;
+    lcdcon_mark_dirty(xpos, ypos, 1, 1);
 }
 
 static void lcdcon_putcs(struct vc_data *conp, const unsigned short *s,
 			 int count, int ypos, int xpos)
 {
-    lcdcon_goto(xpos, ypos);
-    while (count--) {
-	lcd_write(*s);
-	lcdcon_data[ypos*LCD_COLS+xpos++] = *s++;
-    }
-    lcdcon_goto_cursor();
+    u8 *p = &lcdcon_data[ypos*lcdcon_cols+xpos];
+    int i;
+
+    for (i = 0; i < count; i++)
+	p[i] = s[i];
+    lcdcon_mark_dirty(xpos, ypos, count, 1);
 }
 
 static void lcdcon_cursor(struct vc_data *conp, int mode)
@@ -118,16 +296,21 @@ static void lcdcon_cursor(struct vc_data *conp, int mode)
     switch (mode) {
 	case CM_ERASE:
 	    lcdcon_cursor_shown = 0;
-	    lcd_ctrl(LCD_DISP_ON, LCD_CURSOR_OFF, LCD_BLINK_OFF);
+	    lcdcon_cursor_changed();
 	    break;
 
 	case CM_MOVE:
 	case CM_DRAW:
+	    if (lcdcon_cursor_shown && lcdcon_cur_x == conp->vc_x &&
+		lcdcon_cur_y == conp->vc_y)
+		break;
 	    lcdcon_cursor_shown = 1;
 	    lcdcon_cur_x = conp->vc_x;
 	    lcdcon_cur_y = conp->vc_y;
-	    lcdcon_goto_cursor();
-	    lcd_ctrl(LCD_DISP_ON, LCD_CURSOR_ON, LCD_BLINK_ON);
+	    if (lcdcon_following && lcdcon_follow_cursor())
+		lcdcon_mark_view();
+	    else
+		lcdcon_cursor_changed();
 	    break;
     }
 }
@@ -137,43 +320,44 @@ static int lcdcon_scroll(struct vc_data *conp, int t, int b, int dir,
 {
     switch (dir) {
 	case SM_UP:
-	    memmove(&lcdcon_data[t*LCD_COLS], &lcdcon_data[(t+lines)*LCD_COLS],
-		    (b-t-lines)*LCD_COLS);
-	    memset(&lcdcon_data[(b-lines)*LCD_COLS], ' ', lines*LCD_COLS);
-	    lcdcon_redraw_region(0, t, LCD_COLS, b-t);
+	    memmove(&lcdcon_data[t*lcdcon_cols],
+		    &lcdcon_data[(t+lines)*lcdcon_cols],
+		    (b-t-lines)*lcdcon_cols);
+	    memset(&lcdcon_data[(b-lines)*lcdcon_cols], ' ',
+		   lines*lcdcon_cols);
 	    break;
 
 	case SM_DOWN:
-	    memmove(&lcdcon_data[(t+lines)*LCD_COLS], &lcdcon_data[t*LCD_COLS],
-		    (b-t-lines)*LCD_COLS);
-	    memset(&lcdcon_data[t*LCD_COLS], ' ', lines*LCD_COLS);
-	    lcdcon_redraw_region(0, t, LCD_COLS, b-t);
+	    memmove(&lcdcon_data[(t+lines)*lcdcon_cols],
+		    &lcdcon_data[t*lcdcon_cols], (b-t-lines)*lcdcon_cols);
+	    memset(&lcdcon_data[t*lcdcon_cols], ' ', lines*lcdcon_cols);
 	    break;
     }
+    lcdcon_mark_dirty(0, t, lcdcon_cols, b-t);
     return 0;
 }
 
 static void lcdcon_bmove(struct vc_data *conp, int sy, int sx, int dy, int dx,
 			 int height, int width)
 {
-    char *src, *dst;
+    u8 *src, *dst;
     int i;
 
-    if (sx == 0 && dx == 0 && width == LCD_COLS)
-	memmove(&lcdcon_data[dy*LCD_COLS], &lcdcon_data[sy*LCD_COLS],
-		height*LCD_COLS);
+    if (sx == 0 && dx == 0 && width == lcdcon_cols)
+	memmove(&lcdcon_data[dy*lcdcon_cols], &lcdcon_data[sy*lcdcon_cols],
+		height*lcdcon_cols);
     else if (dy < sy || (dy == sy && dx < sx)) {
-	src = &lcdcon_data[sy*LCD_COLS+sx];
-	dst = &lcdcon_data[dy*LCD_COLS+dx];
-	for (i = height; i > 0; i--, src += LCD_COLS, dst += LCD_COLS)
+	src = &lcdcon_data[sy*lcdcon_cols+sx];
+	dst = &lcdcon_data[dy*lcdcon_cols+dx];
+	for (i = height; i > 0; i--, src += lcdcon_cols, dst += lcdcon_cols)
 	    memmove(dst, src, width);
     } else {
-	src = &lcdcon_data[(sy+height-1)*LCD_COLS+sx];
-	dst = &lcdcon_data[(dy+height-1)*LCD_COLS+dx];
-	for (i = height; i > 0; i--, src -= LCD_COLS, dst -= LCD_COLS)
+	src = &lcdcon_data[(sy+height-1)*lcdcon_cols+sx];
+	dst = &lcdcon_data[(dy+height-1)*lcdcon_cols+dx];
+	for (i = height; i > 0; i--, src -= lcdcon_cols, dst -= lcdcon_cols)
 	    memmove(dst, src, width);
     }
-    lcdcon_redraw_region(dx, dy, width, height);
+    lcdcon_mark_dirty(dx, dy, width, height);
 }
 
 static int lcdcon_switch(struct vc_data *conp)
@@ -183,7 +367,7 @@ static int lcdcon_switch(struct vc_data *conp)
 
 static int lcdcon_blank(struct vc_data *conp, int blank)
 {
-    lcd_backlight(blank ? 0 : 1);
+    lcd_backlight(lcdcon_lcd, blank ? 0 : 1);
     return 0;
 }
 
@@ -197,8 +381,17 @@ static int lcdcon_set_palette(struct vc_data *vc, unsigned char *table)
     return -EINVAL;
 }
 
+    /*
+     *  Scrollback pans the viewport, returning to the bottom follows the
+     *  cursor again
+     */
+
 static int lcdcon_scrolldelta(struct vc_data *vc, int lines)
 {
+    if (lines)
+	lcdcon_pan(lcdcon_view_x, lcdcon_view_y+lines);
+    else
+	lcdcon_follow();
     return 0;
 }
 
@@ -223,6 +416,21 @@ static struct consw lcd_con = {
 #ifdef MODULE
 int init_module(void)
 {
+    lcdcon_lcd = lcd_console_dev;
+    if (!lcdcon_lcd)
+	return -ENODEV;
+    if (lcdcon_cols > LCDCON_COLS)
+	lcdcon_cols = LCDCON_COLS;
+    if (lcdcon_cols < lcdcon_lcd->cols)
+	lcdcon_cols = lcdcon_lcd->cols;
+    if (lcdcon_rows > LCDCON_ROWS)
+	lcdcon_rows = LCDCON_ROWS;
+    if (lcdcon_rows < lcdcon_lcd->rows)
+	lcdcon_rows = lcdcon_lcd->rows;
+    memset(lcdcon_data, ' ', sizeof(lcdcon_data));
+    init_timer(&lcdcon_flush_timer);
+    lcdcon_flush_timer.function = lcdcon_flush_timer_func;
+    INIT_TQUEUE(&lcdcon_flush_task, lcdcon_flush_task_func, NULL);
     take_over_console(&lcd_con, 6-1, 6-1, 0);
     return 0;
 }
@@ -230,5 +438,7 @@ int init_module(void)
 void cleanup_module(void)
 {
     give_up_console(&lcd_con);
+    del_timer_sync(&lcdcon_flush_timer);
+    flush_scheduled_tasks();
 }
 #endif /* MODULE */
@@ -0,0 +1,255 @@
+
+/*
+ *  Event loop scheduler for driving many HD44780 LCDs
+ *
+ *  This programs is subject to the terms and conditions of the GNU General
+ *  Public License
+ */
+
+
+#include <errno.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+typedef unsigned char u8;
+
+#include "hd44780.h"
+#include "lcdsched.h"
+
+
+    /*
+     *  Deadlines closer than this are waited for with lcd_udelay(), as
+     *  epoll_wait() wakes up too late for them
+     */
+
+#define LCD_SCHED_SLACK_US	100
+
+
+    /*
+     *  Scheduler Control
+     */
+
+int lcd_sched_init(struct lcd_sched *s)
+{
+    struct epoll_event ev;
+
+    memset(s, 0, sizeof(*s));
+    s->timer_fd = -1;
+    if ((s->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+	return -1;
+    if ((s->timer_fd = timerfd_create(CLOCK_MONOTONIC,
+				      TFD_NONBLOCK | TFD_CLOEXEC)) < 0)
+	goto fail;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    if (epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, s->timer_fd, &ev))
+	goto fail;
+    return 0;
+
+fail:
+    lcd_sched_cleanup(s);
+    return -1;
+}
+
+void lcd_sched_cleanup(struct lcd_sched *s)
+{
+    if (s->timer_fd >= 0)
+	close(s->timer_fd);
+    if (s->epoll_fd >= 0)
+	close(s->epoll_fd);
+    s->timer_fd = s->epoll_fd = -1;
+}
+
+    /*
+     *  Returns the display's queue number, or -1 if there are too many
+     */
+
+int lcd_sched_add(struct lcd_sched *s, struct lcd_device *lcd)
+{
+    if (s->n == LCD_SCHED_MAX)
+	return -1;
+    memset(&s->queue[s->n], 0, sizeof(s->queue[s->n]));
+    s->queue[s->n].lcd = lcd;
+    return s->n++;
+}
+
+int lcd_sched_fd(struct lcd_sched *s)
+{
+    return s->epoll_fd;
+}
+
+    /*
+     *  The timer runs on real time, it's left alone with the virtual clock
+     */
+
+static void lcd_sched_arm(struct lcd_sched *s, long usecs)
+{
+    struct itimerspec its;
+
+    if (lcd_get_clock() != &lcd_clock_real)
+	return;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = usecs/1000000;
+    its.it_value.tv_nsec = (usecs%1000000)*1000;
+    timerfd_settime(s->timer_fd, 0, &its, NULL);
+}
+
+
+    /*
+     *  Queueing Transfers
+     */
+
+static void lcd_sched_put(struct lcd_sched_queue *q, int chip, u8 val, int rs,
+			  unsigned long at)
+{
+    struct lcd_sched_op *op = &q->op[q->tail++ & (LCD_SCHED_QUEUE-1)];
+
+    op->chip = chip;
+    op->rs = rs;
+    op->val = val;
+    op->at = at;
+    q->stats.queued++;
+}
+
+static int lcd_sched_room(struct lcd_sched_queue *q, unsigned int n)
+{
+    unsigned int depth = q->tail-q->head;
+
+    if (depth+n > LCD_SCHED_QUEUE) {
+	q->stats.full += n;
+	return 0;
+    }
+    if (!depth)
+	q->busy_since = lcd_clock_ns();
+    if (depth+n > q->stats.max_depth)
+	q->stats.max_depth = depth+n;
+    return 1;
+}
+
+int lcd_sched_write(struct lcd_sched *s, int q, int chip, u8 val, int rs,
+		    unsigned long at)
+{
+    struct lcd_sched_queue *queue = &s->queue[q];
+
+    if (!lcd_sched_room(queue, 1))
+	return -1;
+    lcd_sched_put(queue, chip, val, rs, at);
+    return 0;
+}
+
+int lcd_sched_text(struct lcd_sched *s, int q, int x, int y, const u8 *buf,
+		   unsigned int n, unsigned long at)
+{
+    struct lcd_sched_queue *queue = &s->queue[q];
+    struct lcd_device *lcd = queue->lcd;
+    int chip;
+
+    if (x < 0 || x > lcd->cols || y < 0 || y >= lcd->rows ||
+	n > lcd->cols-x)
+	return -1;
+    if (!lcd_sched_room(queue, n+1))
+	return -1;
+    chip = y/lcd->chip_rows;
+    lcd_sched_put(queue, chip, LCD_CMD_DDRAM | lcd_cell_addr(lcd, x, y), 0,
+		  at);
+    while (n--)
+	lcd_sched_put(queue, chip, *buf++, 1, 0);
+    return 0;
+}
+
+
+    /*
+     *  Scheduling
+     *
+     *  A transfer is due when its earliest issue time has passed, and its
+     *  controller has finished the previous one. The displays are few enough
+     *  for a linear scan to find the one that is due first.
+     */
+
+static struct lcd_sched_queue *lcd_sched_next(struct lcd_sched *s, long *left)
+{
+    struct lcd_sched_queue *q, *next = NULL;
+    const struct lcd_sched_op *op;
+    const struct lcd_chip *chip;
+    unsigned long now = lcd_clock_ns()/1000;
+    unsigned int i;
+    long t, min = 0;
+
+    for (i = 0; i < s->n; i++) {
+	q = &s->queue[i];
+	if (q->head == q->tail)
+	    continue;
+	op = &q->op[q->head & (LCD_SCHED_QUEUE-1)];
+	chip = &q->lcd->chips[op->chip];
+	t = op->at ? (long)(op->at-now) : 0;
+	if (chip->pending && (long)(chip->ready_at-now) > t)
+	    t = chip->ready_at-now;
+	if (!next || t < min) {
+	    next = q;
+	    min = t;
+	}
+    }
+    *left = min;
+    return next;
+}
+
+static void lcd_sched_issue(struct lcd_sched_queue *q, unsigned long late)
+{
+    const struct lcd_sched_op *op = &q->op[q->head & (LCD_SCHED_QUEUE-1)];
+
+    lcd_select(q->lcd, op->chip);
+    __lcd_write(q->lcd, op->val, op->rs);
+    q->stats.issued++;
+    q->stats.late_us += late;
+    if (++q->head == q->tail)
+	q->stats.busy_ns += lcd_clock_ns()-q->busy_since;
+}
+
+    /*
+     *  Issue all transfers that are due, and arm the timer for the next one.
+     *  Returns the time until then in us, or -1 if all queues are empty.
+     */
+
+long lcd_sched_run(struct lcd_sched *s)
+{
+    struct lcd_sched_queue *q;
+    unsigned long long expired;
+    long left;
+
+    if (read(s->timer_fd, &expired, sizeof(expired)) == sizeof(expired))
+	s->wakeups++;
+    while ((q = lcd_sched_next(s, &left)) && left <= 0)
+	lcd_sched_issue(q, -left);
+    lcd_sched_arm(s, q ? left : 0);
+    return q ? left : -1;
+}
+
+    /*
+     *  Wait for the next transfer, as returned by lcd_sched_run(). With the
+     *  virtual clock, time is just advanced.
+     */
+
+void lcd_sched_wait(struct lcd_sched *s, long usecs)
+{
+    struct epoll_event ev;
+
+    if (usecs > LCD_SCHED_SLACK_US && lcd_get_clock() == &lcd_clock_real) {
+	lcd_sched_arm(s, usecs-LCD_SCHED_SLACK_US);
+	if (epoll_wait(s->epoll_fd, &ev, 1, -1) >= 0 || errno == EINTR)
+	    return;
+    }
+    /* Don't leave the timer armed, or the epoll fd fires after the spin */
+    lcd_sched_arm(s, 0);
+    if (usecs > 0)
+	lcd_udelay(usecs);
+}
+
+void lcd_sched_loop(struct lcd_sched *s)
+{
+    long left;
+
+    while ((left = lcd_sched_run(s)) >= 0)
+	lcd_sched_wait(s, left);
+}
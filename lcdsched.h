@@ -0,0 +1,100 @@
+
+/*
+ *  Event loop scheduler for driving many HD44780 LCDs
+ *
+ *  This programs is subject to the terms and conditions of the GNU General
+ *  Public License
+ */
+
+
+#ifndef _LCDSCHED_H
+#define _LCDSCHED_H
+
+    /*
+     *  Event Loop Scheduler
+     *
+     *  Drives many displays from a single thread. Every display has a queue
+     *  of pending transfers, each with an earliest issue time. The scheduler
+     *  always issues the next transfer of the display that is ready first,
+     *  so instead of waiting for one LCD to execute a transfer, the others
+     *  are written to.
+     *
+     *  lcd_sched_fd() is an epoll instance that becomes readable when the
+     *  next transfer is due, so it can be added to the caller's own event
+     *  loop, which calls lcd_sched_run() whenever it is readable. Otherwise
+     *  lcd_sched_wait() waits for it, and lcd_sched_loop() runs until all
+     *  queues are empty.
+     *
+     *  Queued transfers are issued with __lcd_write(), bypassing the text
+     *  layer, so a later lcd_flush() doesn't know what they wrote to DDRAM.
+     */
+
+#define LCD_SCHED_MAX		32	/* Displays */
+#define LCD_SCHED_QUEUE		256	/* Transfers, must be a power of two */
+
+struct lcd_sched_op {
+    u8 chip, rs, val;
+    unsigned long at;			/* Earliest issue in us, or 0 */
+};
+
+struct lcd_sched_stats {
+    unsigned long queued, issued;
+    unsigned long full;			/* Transfers rejected */
+    unsigned int max_depth;
+    unsigned long late_us;		/* Issued after the deadline */
+    unsigned long long busy_ns;		/* Time with a non-empty queue */
+};
+
+struct lcd_sched_queue {
+    struct lcd_device *lcd;
+    struct lcd_sched_op op[LCD_SCHED_QUEUE];
+    unsigned int head, tail;
+    unsigned long long busy_since;
+    struct lcd_sched_stats stats;
+};
+
+struct lcd_sched {
+    int epoll_fd, timer_fd;
+    unsigned int n;
+    unsigned long wakeups;		/* Timer expirations */
+    struct lcd_sched_queue queue[LCD_SCHED_MAX];
+};
+
+
+    /*
+     *  Scheduler Control
+     */
+
+extern int lcd_sched_init(struct lcd_sched *s);
+extern void lcd_sched_cleanup(struct lcd_sched *s);
+extern int lcd_sched_add(struct lcd_sched *s, struct lcd_device *lcd);
+extern int lcd_sched_fd(struct lcd_sched *s);
+extern long lcd_sched_run(struct lcd_sched *s);
+extern void lcd_sched_wait(struct lcd_sched *s, long usecs);
+extern void lcd_sched_loop(struct lcd_sched *s);
+
+
+    /*
+     *  Queueing Transfers
+     *
+     *  Both return -1 if the display's queue has no room for all of them, in
+     *  which case nothing is queued. lcd_sched_text() queues a DDRAM address
+     *  set followed by the characters, and also returns -1 if the text does
+     *  not fit in row y starting at column x.
+     *
+     *  The earliest issue time is in us on the scheduler's clock, i.e. it is
+     *  compared against lcd_clock_ns()/1000, which may be virtual, and not
+     *  against the timerfd's clock, which is only used to wake up.
+     */
+
+extern int lcd_sched_write(struct lcd_sched *s, int q, int chip, u8 val,
+			   int rs, unsigned long at);
+extern int lcd_sched_text(struct lcd_sched *s, int q, int x, int y,
+			  const u8 *buf, unsigned int n, unsigned long at);
+
+static inline unsigned int lcd_sched_depth(struct lcd_sched *s, int q)
+{
+    return s->queue[q].tail-s->queue[q].head;
+}
+
+#endif /* _LCDSCHED_H */
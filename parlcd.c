@@ -12,6 +12,7 @@
 #include <asm/errno.h>
 #include <linux/ioport.h>
 #include <linux/module.h>
+#include <linux/string.h>
 #include <linux/types.h>
 
 #include <asm/io.h>
@@ -20,6 +21,7 @@
 
 typedef unsigned char u8;
 
+#include <string.h>
 #include <sys/io.h>
 
 #endif /* !__KERNEL__ */
@@ -27,139 +29,364 @@ typedef unsigned char u8;
 #include "hd44780.h"
 #include "parlcd.h"
 
+#ifdef __KERNEL__
+#define PARLCD_MAX	3
+
+static char *parlcd_wiring = "winamp";
+static int parlcd_base[PARLCD_MAX] = { PARPORT_BASE };
+static int parlcd_cols = LCD_DEFAULT_COLS;
+static int parlcd_rows = LCD_DEFAULT_ROWS;
+
+MODULE_PARM(parlcd_wiring, "s");
+MODULE_PARM(parlcd_base, "1-" __MODULE_STRING(PARLCD_MAX) "i");
+MODULE_PARM(parlcd_cols, "i");
+MODULE_PARM(parlcd_rows, "i");
+#endif
+
+#ifdef PARPORT_DUMMY
+u8 parport_dummy[PARPORT_DUMMY_SIZE];
+#endif
+
 
     /*
      *  Parallel Port Register Access
+     *
+     *  We keep copies of the data and control registers, so modifying them
+     *  needs no reads, and writes of the value already on the port can be
+     *  skipped. Reading the data register returns the data lines when the port
+     *  is in input mode, so it is never used to refresh the copy.
      */
 
-static inline void parport_mod_data(u8 clear, u8 set)
+static inline u8 parlcd_in(struct parlcd *p, unsigned int reg)
 {
-    parport_write_data((parport_read_data() & ~clear) | set);
+    p->lcd.stats.io++;
+    return parport_in(p->base+reg);
 }
 
+static inline void parlcd_out(struct parlcd *p, u8 val, unsigned int reg)
+{
+    p->lcd.stats.io++;
+    parport_out(val, p->base+reg);
+}
 
-static inline void parport_mod_control(u8 clear, u8 set)
+static inline void parport_set_data(struct parlcd *p, u8 val)
 {
-    parport_write_control((parport_read_control() & ~clear) | set);
+    if (p->lcd.seq_recording) {
+	lcd_seq_out(&p->lcd, PARPORT_DATA, val, 1);
+	return;
+    }
+    if (val != p->data) {
+	p->data = val;
+	parlcd_out(p, val, PARPORT_DATA);
+    }
 }
 
+    /*
+     *  Reload the register copies, after someone else accessed the port
+     */
 
-/* ------------------------------------------------------------------------- */
+void parlcd_sync(struct parlcd *p)
+{
+    p->data = parlcd_in(p, PARPORT_DATA);
+    p->control = parlcd_in(p, PARPORT_CONTROL);
+}
 
 
-#if 0 /* -- Custom wiring -------------------------------------------------- */
+/* ------------------------------------------------------------------------- */
 
 
     /*
-     *  Low-Level LCD Access
+     *  Pin Map
      *
-     *  These are hardware dependent!
+     *  The LCD's control signals can be wired to any of the parallel port's
+     *  control lines, or RW, E2 and the backlight to nothing at all. Two
+     *  common wirings are available as presets:
      *
-     *  Wiring:
+     *	    LCD		custom		winamp
+     *	    ------------------------------------
+     *	    RS		*SELECTIN	*INIT
+     *	    RW		*AUTOFD		*AUTOFD
+     *	    E		*INIT		*STROBE
+     *	    E2		-		-
+     *	    Backlight	*STROBE		*SELECTIN
+     *	    D0-D7	D0-D7		D0-D7	(D4-D7 for a 4 bit bus)
      *
-     *	    LCD		Parport (8 bit)		Parport (4 bit)
-     *	    ------------------------------------------------------
-     *	    RS		*SELECTIN		*SELECTIN
-     *	    RW		*AUTOFD (or GND)	*AUTOFD (or GND)
-     *	    E		*INIT			*INIT
-     *	    Backlight	*STROBE			*STROBE
-     *	    D0		D0			-
-     *	    D1		D1			-
-     *	    D2		D2			-
-     *	    D3		D3			-
-     *	    D4		D4			D4
-     *	    D5		D5			D5
-     *	    D6		D6			D6
-     *	    D7		D7			D7
+     *  Other wirings can be given as e.g. "rs=init,rw=gnd,e=strobe,bl=select".
+     *  The inverted lines are handled automatically. A module with two
+     *  controllers needs E2 for the second one, e.g. "rw=gnd,e2=autofd" on
+     *  top of winamp.
+     */
+
+#define PARLCD_LINES	(PARPORT_CONTROL_STROBE | PARPORT_CONTROL_AUTOFD | \
+			 PARPORT_CONTROL_INIT | PARPORT_CONTROL_SELECT)
+#define PARLCD_INVERTED	(PARPORT_CONTROL_STROBE | PARPORT_CONTROL_AUTOFD | \
+			 PARPORT_CONTROL_SELECT)	/* Active low */
+
+static const struct {
+    const char *name;
+    struct parlcd_pins pins;
+} parlcd_presets[] = {
+    {
+	"custom", {
+	    rs:	PARPORT_CONTROL_SELECT,
+	    rw:	PARPORT_CONTROL_AUTOFD,
+	    e:	PARPORT_CONTROL_INIT,
+	    bl:	PARPORT_CONTROL_STROBE
+	}
+    }, {
+	"winamp", {
+	    rs:	PARPORT_CONTROL_INIT,
+	    rw:	PARPORT_CONTROL_AUTOFD,
+	    e:	PARPORT_CONTROL_STROBE,
+	    bl:	PARPORT_CONTROL_SELECT
+	}
+    }
+};
+
+static const struct {
+    const char *name;
+    u8 line;
+} parlcd_lines[] = {
+    { "strobe", PARPORT_CONTROL_STROBE },
+    { "autofd", PARPORT_CONTROL_AUTOFD },
+    { "init", PARPORT_CONTROL_INIT },
+    { "select", PARPORT_CONTROL_SELECT },
+    { "gnd", 0 },
+};
+
+#define arraysize(x)	(sizeof(x)/sizeof(*(x)))
+
+    /*
+     *  Control register values for all signal combinations, indexed by
+     *  PARLCD_SIG_*
      */
 
-#define PARLCD_RS	(PARPORT_CONTROL_SELECT)	/* inverted! */
-#define PARLCD_RW	(PARPORT_CONTROL_AUTOFD)	/* inverted! */
-#define PARLCD_E	(PARPORT_CONTROL_INIT)
-#define PARLCD_BL	(PARPORT_CONTROL_STROBE)	/* inverted! */
+#define PARLCD_SIG_RS		0x1
+#define PARLCD_SIG_RW		0x2
+#define PARLCD_SIG_E		0x4	/* One per controller, e_mask order */
+#define PARLCD_SIG_E2		0x8
+#define PARLCD_SIG_BL		0x10
 
-#define PARLCD_RS_1	0
-#define PARLCD_RS_0	PARLCD_RS
-#define PARLCD_RW_1	0
-#define PARLCD_RW_0	PARLCD_RW
-#define PARLCD_E_1	PARLCD_E
-#define PARLCD_E_0	0
-#define PARLCD_BL_1	0
-#define PARLCD_BL_0	PARLCD_BL
+#define PARLCD_SIG_E_SHIFT	2
+#define PARLCD_SIG_E_ALL	(PARLCD_SIG_E | PARLCD_SIG_E2)
 
+#define PARLCD_LEVEL(line, level)	\
+    (((level) ? (line) : 0) ^ ((line) & PARLCD_INVERTED))
 
-#else /* -- WinAmp wiring -------------------------------------------------- */
+#define PARLCD_CTRL(rs, rw, e, e2, bl, sig)			\
+    (PARLCD_LEVEL(rs, (sig) & PARLCD_SIG_RS) |			\
+     PARLCD_LEVEL(rw, (sig) & PARLCD_SIG_RW) |			\
+     PARLCD_LEVEL(e, (sig) & PARLCD_SIG_E) |			\
+     PARLCD_LEVEL(e2, (sig) & PARLCD_SIG_E2) |			\
+     PARLCD_LEVEL(bl, (sig) & PARLCD_SIG_BL) |			\
+     ((sig) & PARLCD_SIG_RW ? PARPORT_CONTROL_DIRECTION : 0))
 
+#ifdef LCD_STATIC_PARLCD
 
     /*
-     *  Low-Level LCD Access
-     *
-     *  These are hardware dependent!
-     *
-     *  Wiring:
-     *
-     *	    LCD		Parport (8 bit)		Parport (4 bit)
-     *	    ------------------------------------------------------
-     *	    RS		*INIT			*INIT
-     *	    RW		*AUTOFD (or GND)	*AUTOFD (or GND)
-     *	    E		*STROBE			*STROBE
-     *	    Backlight	*SELECTIN		*SELECTIN
-     *	    D0		D0			-
-     *	    D1		D1			-
-     *	    D2		D2			-
-     *	    D3		D3			-
-     *	    D4		D4			D4
-     *	    D5		D5			D5
-     *	    D6		D6			D6
-     *	    D7		D7			D7
+     *  In the static build (see parlcd_static.c) the wiring is fixed, and the
+     *  table is a constant the compiler can fold into the port accesses.
+     *  Control register bits not used by the LCD are assumed to be zero.
      */
 
-#define PARLCD_RS	(PARPORT_CONTROL_INIT)
-#define PARLCD_RW	(PARPORT_CONTROL_AUTOFD)	/* inverted! */
-#define PARLCD_E	(PARPORT_CONTROL_STROBE)	/* inverted! */
-#define PARLCD_BL	(PARPORT_CONTROL_SELECT)	/* inverted! */
+#ifdef PARLCD_WIRING_CUSTOM
+#define PARLCD_PIN_RS		PARPORT_CONTROL_SELECT
+#define PARLCD_PIN_RW		PARPORT_CONTROL_AUTOFD
+#define PARLCD_PIN_E		PARPORT_CONTROL_INIT
+#define PARLCD_PIN_BL		PARPORT_CONTROL_STROBE
+#else
+#define PARLCD_PIN_RS		PARPORT_CONTROL_INIT
+#define PARLCD_PIN_RW		PARPORT_CONTROL_AUTOFD
+#define PARLCD_PIN_E		PARPORT_CONTROL_STROBE
+#define PARLCD_PIN_BL		PARPORT_CONTROL_SELECT
+#endif
+#define PARLCD_PIN_E2		0	/* All lines are taken */
+
+#define PARLCD_STATIC_CTRL(sig)						\
+    PARLCD_CTRL(PARLCD_PIN_RS, PARLCD_PIN_RW, PARLCD_PIN_E,		\
+		PARLCD_PIN_E2, PARLCD_PIN_BL, sig)
+#define PARLCD_STATIC_CTRL4(sig)					\
+    PARLCD_STATIC_CTRL(sig), PARLCD_STATIC_CTRL((sig)+1),		\
+    PARLCD_STATIC_CTRL((sig)+2), PARLCD_STATIC_CTRL((sig)+3)
+
+static const struct parlcd_pins parlcd_static_pins = {
+    rs:	PARLCD_PIN_RS,
+    rw:	PARLCD_PIN_RW,
+    e:	PARLCD_PIN_E,
+    e2:	PARLCD_PIN_E2,
+    bl:	PARLCD_PIN_BL
+};
+
+static const u8 parlcd_static_table[32] = {
+    PARLCD_STATIC_CTRL4(0), PARLCD_STATIC_CTRL4(4), PARLCD_STATIC_CTRL4(8),
+    PARLCD_STATIC_CTRL4(12), PARLCD_STATIC_CTRL4(16), PARLCD_STATIC_CTRL4(20),
+    PARLCD_STATIC_CTRL4(24), PARLCD_STATIC_CTRL4(28)
+};
+
+#define PARLCD_DEFAULT_PINS	parlcd_static_pins
+
+static inline const u8 *parlcd_table(struct parlcd *p)
+{
+    return parlcd_static_table;
+}
+
+#else /* !LCD_STATIC_PARLCD */
+
+#define PARLCD_DEFAULT_PINS	(parlcd_presets[1].pins)	/* winamp */
+
+static inline const u8 *parlcd_table(struct parlcd *p)
+{
+    return p->table;
+}
 
-#define PARLCD_RS_1	PARLCD_RS
-#define PARLCD_RS_0	0
-#define PARLCD_RW_1	0
-#define PARLCD_RW_0	PARLCD_RW
-#define PARLCD_E_1	0
-#define PARLCD_E_0	PARLCD_E
-#define PARLCD_BL_1	0
-#define PARLCD_BL_0	PARLCD_BL
+static void parlcd_build_table(struct parlcd *p)
+{
+    u8 base = p->control & ~(PARLCD_LINES | PARPORT_CONTROL_DIRECTION);
+    unsigned int sig;
 
+    for (sig = 0; sig < 32; sig++)
+	p->table[sig] = base | PARLCD_CTRL(p->pins.rs, p->pins.rw, p->pins.e,
+					   p->pins.e2, p->pins.bl, sig);
+}
 
-#endif /* ------------------------------------------------------------------ */
+#endif /* !LCD_STATIC_PARLCD */
 
+static int parlcd_parse_line(const char *s, unsigned int len, u8 *line)
+{
+    unsigned int i;
+
+    for (i = 0; i < arraysize(parlcd_lines); i++)
+	if (strlen(parlcd_lines[i].name) == len &&
+	    !strncmp(s, parlcd_lines[i].name, len)) {
+	    *line = parlcd_lines[i].line;
+	    return 0;
+	}
+    return -1;
+}
 
     /*
-     *  Set the Register Select and Read/Write Signals
+     *  Select the wiring, by preset name or as a list of signal=line pairs.
+     *  Signals not mentioned keep their current line.
      */
 
-static inline void parlcd_set_rs_rw(int rs, int rw)
+int parlcd_set_pins(struct parlcd *p, const char *spec)
 {
-    parport_mod_control(PARLCD_RS | PARLCD_RW,
-			(rs ? PARLCD_RS_1 : PARLCD_RS_0) |
-			(rw ? PARLCD_RW_1 : PARLCD_RW_1));
+    struct parlcd_pins pins = p->pins.e ? p->pins : PARLCD_DEFAULT_PINS;
+    const char *s, *eq;
+    unsigned int i, len;
+    u8 *sig;
+
+    for (i = 0; i < arraysize(parlcd_presets); i++)
+	if (!strcmp(spec, parlcd_presets[i].name)) {
+	    pins = parlcd_presets[i].pins;
+	    goto done;
+	}
+
+    for (s = spec; *s; s += len+(s[len] == ',')) {
+	for (len = 0; s[len] && s[len] != ','; len++);
+	for (eq = s; eq < s+len && *eq != '='; eq++);
+	if (eq == s+len)
+	    return -1;
+	if (eq-s == 2 && !strncmp(s, "rs", 2))
+	    sig = &pins.rs;
+	else if (eq-s == 2 && !strncmp(s, "rw", 2))
+	    sig = &pins.rw;
+	else if (eq-s == 1 && !strncmp(s, "e", 1))
+	    sig = &pins.e;
+	else if (eq-s == 2 && !strncmp(s, "e2", 2))
+	    sig = &pins.e2;
+	else if (eq-s == 2 && !strncmp(s, "bl", 2))
+	    sig = &pins.bl;
+	else
+	    return -1;
+	if (parlcd_parse_line(eq+1, s+len-eq-1, sig))
+	    return -1;
+    }
+
+done:
+    /* RS and E are mandatory, and no line can drive two signals */
+    if (!pins.rs || !pins.e ||
+	(pins.rs & (pins.rw | pins.e | pins.e2 | pins.bl)) ||
+	(pins.rw & (pins.e | pins.e2 | pins.bl)) ||
+	(pins.e & (pins.e2 | pins.bl)) || (pins.e2 & pins.bl))
+	return -1;
+#ifdef LCD_STATIC_PARLCD
+    /* Only the wiring we were built for */
+    if (pins.rs != parlcd_static_pins.rs || pins.rw != parlcd_static_pins.rw ||
+	pins.e != parlcd_static_pins.e || pins.e2 != parlcd_static_pins.e2 ||
+	pins.bl != parlcd_static_pins.bl)
+	return -1;
+    p->pins = pins;
+#else
+    p->pins = pins;
+    parlcd_build_table(p);
+#endif
+    return 0;
 }
 
 
     /*
-     *  Set the Enable Signal
+     *  Low-Level LCD Access
+     *
+     *  Every signal change is a table lookup and a single write of the
+     *  control register. For reads, the data lines are switched to input
+     *  mode, so the LCD can drive them (requires a bidirectional port).
+     *  E pulses go to the E lines of the controllers in the device's e_mask.
      */
-static inline void parlcd_set_e(int e)
+
+#define parlcd_sig_e(p)		((p)->lcd.e_mask << PARLCD_SIG_E_SHIFT)
+
+static inline void parlcd_out_sig(struct parlcd *p, unsigned int sig)
 {
-    parport_mod_control(PARLCD_E, e ? PARLCD_E_1 : PARLCD_E_0);
+    u8 val = parlcd_table(p)[sig];
+
+    if (p->lcd.seq_recording) {
+	lcd_seq_out(&p->lcd, PARPORT_CONTROL, val, 0);
+	return;
+    }
+    if (val != p->control) {
+	p->control = val;
+	parlcd_out(p, val, PARPORT_CONTROL);
+    }
 }
 
-
     /*
-     *  Set the Blanking Signal
+     *  While recording, nothing reaches the port, so the live signals are left
+     *  alone. The sequence starts from them.
      */
 
-static inline void parlcd_set_bl(int bl)
+static inline void parlcd_set_sig(struct parlcd *p, unsigned int clear,
+				  unsigned int set)
+{
+    struct lcd_seq *seq = p->lcd.seq_recording;
+
+    if (seq) {
+	if (seq->last[PARPORT_CONTROL] < 0)
+	    p->seq_sig = p->sig;
+	p->seq_sig = (p->seq_sig & ~clear) | set;
+	parlcd_out_sig(p, p->seq_sig);
+	return;
+    }
+    p->sig = (p->sig & ~clear) | set;
+    parlcd_out_sig(p, p->sig);
+}
+
+static inline void parlcd_set_rs_rw(struct lcd_device *lcd, int rs, int rw)
+{
+    parlcd_set_sig(lcd->priv, PARLCD_SIG_RS | PARLCD_SIG_RW,
+		   (rs ? PARLCD_SIG_RS : 0) | (rw ? PARLCD_SIG_RW : 0));
+}
+
+static inline void parlcd_set_e(struct lcd_device *lcd, int e)
+{
+    struct parlcd *p = lcd->priv;
+
+    parlcd_set_sig(p, PARLCD_SIG_E_ALL, e ? parlcd_sig_e(p) : 0);
+}
+
+static inline void parlcd_set_bl(struct lcd_device *lcd, int bl)
 {
-    parport_mod_control(PARLCD_BL, bl ? PARLCD_BL_1 : PARLCD_BL_0);
+    parlcd_set_sig(lcd->priv, PARLCD_SIG_BL, bl ? PARLCD_SIG_BL : 0);
 }
 
 
@@ -170,22 +397,126 @@ static inline void parlcd_set_bl(int bl)
      *  For 4 bit operation, data is transfered using the 4 MSB bits only
      */
 
-static int parlcd_bus_width = 8;
+#ifdef LCD_STATIC_PARLCD
+#define parlcd_bus_width(p)	PARLCD_WIDTH
+#else
+#define parlcd_bus_width(p)	((p)->width)
+#endif
 
-static void parlcd_set_data(u8 val)
+static void parlcd_set_data(struct lcd_device *lcd, u8 val)
 {
-    if (parlcd_bus_width == 4)
+    struct parlcd *p = lcd->priv;
+
+    if (parlcd_bus_width(p) == 4)
 	val |= 0x0f;		/* Drive unconnected lines high */
-    parport_write_data(val);
+    parport_set_data(p, val);
 }
 
-static inline u8 parlcd_get_data(void)
+static inline u8 parlcd_get_data(struct lcd_device *lcd)
 {
-    return parport_read_data();
+    return parlcd_in(lcd->priv, PARPORT_DATA);
+}
+
+
+    /*
+     *  High-Level LCD Access
+     *
+     *  The same signal sequences as the generic code in hd44780.c, without
+     *  an indirect call per signal. RS and RW must be stable before E rises,
+     *  and held after E falls, so they can't share a port write with E.
+     *  Hence a byte takes 2 control writes per E pulse, plus 1 control write
+     *  if RS or RW change, plus 1 data write per E pulse if the data changes.
+     */
+
+static inline void parlcd_pulse_e(struct parlcd *p, unsigned int sig)
+{
+    parlcd_out_sig(p, sig | parlcd_sig_e(p));
+    lcd_delay_strobe(&p->lcd);
+    parlcd_out_sig(p, sig);
+}
+
+static inline void parlcd_write(struct lcd_device *lcd, u8 val, int rs)
+{
+    struct parlcd *p = lcd->priv;
+    unsigned int sig = (p->sig & PARLCD_SIG_BL) | (rs ? PARLCD_SIG_RS : 0);
+
+    parlcd_out_sig(p, sig);
+    p->sig = sig;
+    if (lcd_bus_width(lcd) == 4) {
+	/* Write High Nibble */
+	parport_set_data(p, val | 0x0f);
+	parlcd_pulse_e(p, sig);
+	lcd_delay_strobe(lcd);
+	/* Write Low Nibble */
+	parport_set_data(p, (val << 4) | 0x0f);
+    } else
+	parlcd_set_data(lcd, val);
+    parlcd_pulse_e(p, sig);
+}
+
+static void parlcd_write_vec(struct lcd_device *lcd, const u8 *buf,
+			     unsigned int n, int rs)
+{
+    parlcd_write(lcd, *buf++, rs);
+    while (--n) {
+	lcd_wait_write(lcd);
+	parlcd_write(lcd, *buf++, rs);
+    }
+}
+
+    /*
+     *  Replay a compiled sequence. Port numbers are offsets from the base.
+     */
+
+static void parlcd_run_seq(struct lcd_device *lcd, const struct lcd_seq *seq)
+{
+    struct parlcd *p = lcd->priv;
+    const struct lcd_step *step, *end = seq->step+seq->n;
+    int last;
+
+    for (step = seq->step; step < end; step++)
+	if (step->op == LCD_SEQ_OUT)
+	    parlcd_out(p, step->val, step->arg);
+	else
+	    lcd_ndelay(lcd, step->arg);
+    if ((last = seq->last[PARPORT_DATA]) >= 0)
+	p->data = seq->step[last].val;
+    if ((last = seq->last[PARPORT_CONTROL]) >= 0)
+	p->control = seq->step[last].val;
+}
+
+static u8 parlcd_read(struct lcd_device *lcd, int rs)
+{
+    struct parlcd *p = lcd->priv;
+    unsigned int sig = (p->sig & PARLCD_SIG_BL) | PARLCD_SIG_RW |
+		       (rs ? PARLCD_SIG_RS : 0);
+    u8 val;
+
+    parlcd_out_sig(p, sig);
+    p->sig = sig;
+    /* Read Byte or High Nibble */
+    parlcd_out_sig(p, sig | parlcd_sig_e(p));
+    lcd_delay_strobe(lcd);
+    val = parlcd_in(p, PARPORT_DATA);
+    parlcd_out_sig(p, sig);
+    if (lcd_bus_width(lcd) == 4) {
+	val &= 0xf0;
+	lcd_delay_strobe(lcd);
+	/* Read Low Nibble */
+	parlcd_out_sig(p, sig | parlcd_sig_e(p));
+	lcd_delay_strobe(lcd);
+	val |= parlcd_in(p, PARPORT_DATA) >> 4;
+	parlcd_out_sig(p, sig);
+    }
+    return val;
 }
 
 
 static const struct lcd_driver parlcd_driver = {
+    write:	parlcd_write,
+    read:	parlcd_read,
+    write_vec:	parlcd_write_vec,
+    run_seq:	parlcd_run_seq,
     set_rs_rw:	parlcd_set_rs_rw,
     set_e:	parlcd_set_e,
     set_bl:	parlcd_set_bl,
@@ -198,38 +529,88 @@ static const struct lcd_driver parlcd_driver = {
      *  Parallel Port LCD Control
      */
 
-void parlcd_init(int width)
+int parlcd_init(struct parlcd *p, unsigned int base, int width)
 {
-    parlcd_bus_width = width;
-    lcd_register_driver(&parlcd_driver);
-    lcd_init(width);
+    if (!p->pins.e)
+	p->pins = PARLCD_DEFAULT_PINS;
+    /* Every controller needs its own E line */
+    if (p->lcd.nchips > 1 && !p->pins.e2)
+	return -1;
+    p->base = base;
+#ifdef LCD_STATIC_PARLCD
+    width = PARLCD_WIDTH;
+    parlcd_sync(p);
+#else
+    p->width = width;
+    parlcd_sync(p);
+    parlcd_build_table(p);
+#endif
+    lcd_register_driver(&p->lcd, &parlcd_driver, p);
+    lcd_init(&p->lcd, width);
+    return 0;
 }
 
-void parlcd_cleanup(void)
+void parlcd_cleanup(struct parlcd *p)
 {
-    lcd_cleanup();
-    lcd_unregister_driver(&parlcd_driver);
+    lcd_cleanup(&p->lcd);
+    lcd_unregister_driver(&p->lcd, &parlcd_driver);
 }
 
 #ifdef MODULE
+static struct parlcd parlcd_dev[PARLCD_MAX];
+
+static void parlcd_release(void)
+{
+    int i;
+
+    for (i = 0; i < PARLCD_MAX; i++)
+	if (parlcd_dev[i].base) {
+	    parlcd_cleanup(&parlcd_dev[i]);
+	    release_region(parlcd_dev[i].base, PARPORT_SIZE);
+	}
+}
+
 int init_module(void)
 {
-    if (check_region(PARPORT_BASE, 3))
-	return -EBUSY;
-    request_region(PARPORT_BASE, 3, "parlcd");
-    parlcd_init(8);
+    int i;
+
+    for (i = 0; i < PARLCD_MAX && parlcd_base[i]; i++) {
+	if (parlcd_set_pins(&parlcd_dev[i], parlcd_wiring)) {
+	    printk("parlcd: invalid wiring %s\n", parlcd_wiring);
+	    parlcd_release();
+	    return -EINVAL;
+	}
+	if (lcd_set_geometry(&parlcd_dev[i].lcd, parlcd_cols, parlcd_rows)) {
+	    printk("parlcd: invalid geometry %dx%d\n", parlcd_cols,
+		   parlcd_rows);
+	    parlcd_release();
+	    return -EINVAL;
+	}
+	if (check_region(parlcd_base[i], PARPORT_SIZE)) {
+	    parlcd_release();
+	    return -EBUSY;
+	}
+	request_region(parlcd_base[i], PARPORT_SIZE, "parlcd");
+	if (parlcd_init(&parlcd_dev[i], parlcd_base[i], 8)) {
+	    printk("parlcd: a %dx%d LCD needs an e2 line\n", parlcd_cols,
+		   parlcd_rows);
+	    release_region(parlcd_base[i], PARPORT_SIZE);
+	    parlcd_release();
+	    return -EINVAL;
+	}
+    }
 #if 0
-    lcd_printf("Welcome to your\n"
+    lcd_printf(&parlcd_dev[0].lcd, "Welcome to your\n"
 	       "Hitachi HD44780U\n"
-	       "driving a 20x4 LCD!\n"
-	       "[%d bit interface]", parlcd_bus_width);
+	       "driving a %dx%d LCD!\n"
+	       "[%d bit interface]", parlcd_cols, parlcd_rows,
+	       parlcd_dev[0].width);
 #endif
     return 0;
 }
 
 void cleanup_module(void)
 {
-    parlcd_cleanup();
-    release_region(PARPORT_BASE, 3);
+    parlcd_release();
 }
 #endif /* MODULE */
@@ -7,20 +7,25 @@
  */
 
 
+#ifndef _PARLCD_H
+#define _PARLCD_H
+
     /*
      *  Parallel Port Register Definitions
      */
 
-#define PARPORT_BASE		0x378
+#define PARPORT_BASE		0x378	/* Default, also 0x278 and 0x3bc */
 
-#define PARPORT_DATA		(PARPORT_BASE+0)
-#define PARPORT_STATUS		(PARPORT_BASE+1)
-#define PARPORT_CONTROL		(PARPORT_BASE+2)
+#define PARPORT_DATA		0	/* Register offsets */
+#define PARPORT_STATUS		1
+#define PARPORT_CONTROL		2
+#define PARPORT_SIZE		3
 
 #define PARPORT_CONTROL_STROBE	0x1
 #define PARPORT_CONTROL_AUTOFD	0x2
 #define PARPORT_CONTROL_INIT	0x4
 #define PARPORT_CONTROL_SELECT	0x8
+#define PARPORT_CONTROL_DIRECTION	0x20	/* 1 = input (bidirectional) */
 
 #define PARPORT_STATUS_ERROR	0x8
 #define PARPORT_STATUS_SELECT	0x10
@@ -33,18 +38,109 @@
      *  Parallel Port Register Access
      */
 
-static inline u8 parport_read_data(void) { return inb(PARPORT_DATA); }
-static inline void parport_write_data(u8 val) { outb(val, PARPORT_DATA); }
-static inline u8 parport_read_status(void) { return inb(PARPORT_STATUS); }
-static inline void parport_write_status(u8 val) { outb(val, PARPORT_STATUS); }
-static inline u8 parport_read_control(void) { return inb(PARPORT_CONTROL); }
-static inline void parport_write_control(u8 val) { outb(val, PARPORT_CONTROL); }
+    /*
+     *  With PARPORT_DUMMY, the ports are a memory array, for benchmarking the
+     *  driver code without hardware. Like on ISA, only 10 address bits are
+     *  decoded.
+     */
+
+#ifdef PARPORT_DUMMY
+#define PARPORT_DUMMY_SIZE	0x400
+extern u8 parport_dummy[PARPORT_DUMMY_SIZE];
+#endif
+
+static inline u8 parport_in(unsigned int port)
+{
+#ifdef PARPORT_DUMMY
+    return parport_dummy[port & (PARPORT_DUMMY_SIZE-1)];
+#else
+    return inb(port);
+#endif
+}
+
+static inline void parport_out(u8 val, unsigned int port)
+{
+#ifdef PARPORT_DUMMY
+    parport_dummy[port & (PARPORT_DUMMY_SIZE-1)] = val;
+#else
+    outb(val, port);
+#endif
+}
+
+static inline u8 parport_read_data(unsigned int base)
+{
+    return parport_in(base+PARPORT_DATA);
+}
+static inline void parport_write_data(unsigned int base, u8 val)
+{
+    parport_out(val, base+PARPORT_DATA);
+}
+static inline u8 parport_read_status(unsigned int base)
+{
+    return parport_in(base+PARPORT_STATUS);
+}
+static inline void parport_write_status(unsigned int base, u8 val)
+{
+    parport_out(val, base+PARPORT_STATUS);
+}
+static inline u8 parport_read_control(unsigned int base)
+{
+    return parport_in(base+PARPORT_CONTROL);
+}
+static inline void parport_write_control(unsigned int base, u8 val)
+{
+    parport_out(val, base+PARPORT_CONTROL);
+}
+
+
+    /*
+     *  Parallel Port LCD Instance
+     *
+     *  One per port, zero it before use. The LCD's control signals are wired
+     *  to the control lines given in pins (see parlcd.c). e2 is the E line of
+     *  the second controller of a module with more than 80 characters.
+     */
+
+struct parlcd_pins {
+    u8 rs, rw, e, e2, bl;
+};
+
+struct parlcd {
+    struct lcd_device lcd;
+    unsigned int base;		/* I/O base address */
+    int width;			/* Bus width */
+    u8 data, control;		/* Register copies */
+    unsigned int sig;		/* Current PARLCD_SIG_* */
+    unsigned int seq_sig;	/* Same, in the sequence being recorded */
+    struct parlcd_pins pins;	/* All zero for the default wiring */
+    u8 table[32];		/* Control register value per signal set */
+};
 
 
     /*
      *  Parallel Port LCD Control
      */
 
-extern void parlcd_init(int width);
-extern void parlcd_cleanup(void);
+extern int parlcd_init(struct parlcd *p, unsigned int base, int width);
+extern void parlcd_cleanup(struct parlcd *p);
+extern void parlcd_sync(struct parlcd *p);
+extern int parlcd_set_pins(struct parlcd *p, const char *spec);
+
+
+    /*
+     *  Static Build
+     *
+     *  With LCD_STATIC_PARLCD, hd44780 and parlcd are compiled as a single
+     *  translation unit (parlcd_static.c), with the driver, the wiring
+     *  (PARLCD_WIRING_CUSTOM, or WinAmp by default) and the bus width
+     *  (PARLCD_WIDTH) fixed at compile time
+     */
+
+#ifdef LCD_STATIC_PARLCD
+#ifndef PARLCD_WIDTH
+#define PARLCD_WIDTH		8
+#endif
+#endif /* LCD_STATIC_PARLCD */
+
+#endif /* _PARLCD_H */
 
@@ -0,0 +1,19 @@
+/*
+ *  Static build of hd44780 and parlcd
+ *
+ *  This programs is subject to the terms and conditions of the GNU General
+ *  Public License
+ */
+
+
+    /*
+     *  Static Build
+     *
+     *  hd44780 bound to parlcd in a single translation unit, so the driver
+     *  functions can be inlined into the mid-level code
+     */
+
+#define LCD_STATIC_PARLCD	1
+
+#include "parlcd.c"
+#include "hd44780.c"
@@ -6,9 +6,11 @@
  *  Public License
  */
 
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <malloc.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -23,14 +25,37 @@ typedef unsigned char u8;
 
 #include "hd44780.h"
 #include "parlcd.h"
+#include "simlcd.h"
+#include "lcdsched.h"
 
 
 static const char *ProgramName = NULL;
 static int Verbose = 0;
 static int Dump = 0;
+static int Busy = 0;
+static int Async = 0;
+static const char *TscFile = NULL;
+static int Emulate = 0;
+static int Cols = LCD_DEFAULT_COLS, Rows = LCD_DEFAULT_ROWS;
 
 static long clk_tck;
 
+    /*
+     *  Displays, either software LCDs or LCDs on parallel ports. Commands go
+     *  to the current one.
+     */
+
+#define MAX_DISPLAYS	LCD_SCHED_MAX
+
+static struct simlcd Simlcd[MAX_DISPLAYS];
+static struct parlcd Parlcd[MAX_DISPLAYS];
+static unsigned int Bases[MAX_DISPLAYS];
+static int NumBases = 0;
+static int NumDisplays = 1;
+static struct lcd_device *Display[MAX_DISPLAYS];
+static int Current = 0;
+static struct lcd_device *Lcd;
+
 
     /*
      *  Function Prototypes
@@ -71,7 +96,12 @@ int main(int argc, char *argv[]);
      *  I/O Port Access
      */
 
-#ifdef __powerpc__
+#if defined(PARPORT_DUMMY)
+
+#define enable_isa_io()		do { } while (0)
+#define disable_isa_io()	do { } while (0)
+
+#elif defined(__powerpc__)
 unsigned long isa_io_base;
 static int io_fd = -1;
 
@@ -103,7 +133,7 @@ static void disable_isa_io(void)
     }
 }
 
-#else /* !__powerpc__ */
+#else /* !PARPORT_DUMMY && !__powerpc__ */
 
 static void enable_isa_io(void)
 {
@@ -114,7 +144,7 @@ static void enable_isa_io(void)
 
 #define disable_isa_io()	do { } while (0)
 
-#endif /* !__powerpc__ */
+#endif /* !PARPORT_DUMMY && !__powerpc__ */
 
 
 /* ------------------------------------------------------------------------- */
@@ -148,13 +178,106 @@ static void Usage(void)
     Die("Usage: %s [options] [file ...]\n\n"
 	"Valid options are:\n"
 	"    --help               Display this usage information\n"
+	"    -a, --async          Dump stdin through the console log buffer\n"
+	"    -b, --busy           Pace writes using the LCD's busy flag\n"
+	"    -B, --base <addr>    Add a parallel port display at <addr> (default\n"
+	"                         0x378)\n"
 	"    -d, --dump           Dump stdin to the LCD\n"
+	"    -e, --emulate        Use a software LCD instead of the parallel port\n"
+	"    -g, --geometry <cols>x<rows>\n"
+	"                         Display geometry (default 20x4)\n"
+	"    -n, --displays <n>   Number of software LCDs\n"
+	"    -p, --pins <map>     Parallel port wiring: winamp (default), custom,\n"
+	"                         or e.g. rs=init,rw=gnd,e=strobe,bl=select\n"
+	"    --pin-file <file>    Read the parallel port wiring from <file>\n"
+	"    -s, --spin <usecs>   Sleep during delays longer than <usecs>\n"
+	"    -t, --tsc <file>     Use the TSC for delays, cache its calibration\n"
+	"                         in <file>\n"
 	"    -v, --verbose        Enable verbose mode\n"
+	"    -V, --virtual        Use virtual time instead of waiting, implies\n"
+	"                         --emulate unless built with PARPORT_DUMMY\n"
 	"\n",
 	ProgramName);
 }
 
 
+/* ------------------------------------------------------------------------- */
+
+
+    /*
+     *  LCD Backend Selection
+     */
+
+#define MAX_PIN_LINE	256
+
+static void SetPins(const char *map)
+{
+    int i;
+
+    for (i = 0; i < MAX_DISPLAYS; i++)
+	if (parlcd_set_pins(&Parlcd[i], map))
+	    Die("Invalid wiring `%s'\n", map);
+}
+
+    /*
+     *  A pin file contains a preset name or signal=line pairs, separated by
+     *  commas or newlines. Leading whitespace is ignored, and everything after
+     *  a `#' is a comment.
+     */
+
+static void ReadPinFile(const char *file)
+{
+    char line[MAX_PIN_LINE], map[MAX_PIN_LINE];
+    size_t len = 0;
+    char *start, *p;
+    FILE *f;
+
+    if (!(f = fopen(file, "r")))
+	Die("%s: %s\n", file, strerror(errno));
+    map[0] = '\0';
+    while (fgets(line, sizeof(line), f)) {
+	for (start = line; isspace(*start); start++);
+	for (p = start; *p && *p != '#' && !isspace(*p); p++);
+	*p = '\0';
+	if (!*start)
+	    continue;
+	if (len+strlen(start)+2 > sizeof(map))
+	    Die("%s: Wiring too long\n", file);
+	if (len)
+	    map[len++] = ',';
+	strcpy(map+len, start);
+	len += strlen(start);
+    }
+    fclose(f);
+    if (!len)
+	Die("%s: No wiring\n", file);
+    SetPins(map);
+}
+
+    /*
+     *  Returns -1 if the wiring can't drive the display's geometry
+     */
+
+static int LcdInit(int display, int width)
+{
+    if (!Emulate)
+	return parlcd_init(&Parlcd[display], Bases[display], width);
+    simlcd_init(&Simlcd[display], width);
+    return 0;
+}
+
+static void LcdCleanup(int display)
+{
+    if (NumDisplays > 1)
+	printf("Display %d:\n", display);
+    if (Emulate) {
+	simlcd_dump(&Simlcd[display]);
+	simlcd_cleanup(&Simlcd[display]);
+    } else
+	parlcd_cleanup(&Parlcd[display]);
+}
+
+
 /* ------------------------------------------------------------------------- */
 
 
@@ -304,8 +427,10 @@ static void Do_Help(int argc, const char **argv)
 	 "\n  General commands\n"
 	 "    Help, ?                Display this help\n"
 	 "    Quit, eXit             Terminate program\n"
+	 "    DIsplay [n]            Show or select the current display\n"
 	 "\n  LCD commands\n"
-	 "    Init [8|4]             Initialize for 20x4 LCD, 8 or 4 bit bus\n"
+	 "    Init [8|4] [<c>x<r>]   Initialize for 8 or 4 bit bus, optionally\n"
+	 "                           changing the geometry\n"
 	 "    HELLo                  Show the welcome message\n"
 	 "    Raw <string>           Print a raw string to the LCD\n"
 	 "    Print <string>         Print a string to the LCD\n"
@@ -317,6 +442,20 @@ static void Do_Help(int argc, const char **argv)
 	 "    Shift Left|Right [cnt] Shift the display left or right\n"
 	 "    CMd <val>              Special LCD command <val>\n"
 	 "    Backlight [on|off]     Control backlight\n"
+	 "    PAcing [delay|busy]    Show or select fixed delays or busy flag\n"
+	 "                           polling\n"
+	 "    SCreen                 Dump the software LCD's screen\n"
+	 "    Bench [workload ...]   Run benchmark workloads (hello, redraw,\n"
+	 "                           scroll, font, console, cgram, frame,\n"
+	 "                           template, mirror, vt-op, vt-line,\n"
+	 "                           vt-burst)\n"
+	 "    Threads [workload ...] Run them on all displays, one thread each\n"
+	 "    SCHed [frames]         Draw frames on all displays from a single\n"
+	 "                           event loop\n"
+	 "    CHeck                  Run the self-checks on a software LCD\n"
+	 "    LOG <string>           Append a line to the console log\n"
+	 "    DRain                  Show the pending console log messages\n"
+	 "    LOGLevel <val>         Drop log messages with level <val> or higher\n"
 	 "\n  Parallel port commands\n"
 	 "    Data                   Dump the data register\n"
 	 "    Data <val>             Write <val> to the data register\n"
@@ -332,16 +471,58 @@ static void Do_Quit(int argc, const char **argv)
     Stop = 1;
 }
 
-static void Do_Init(int argc, const char *argv[])
+static void Do_Display(int argc, const char *argv[])
 {
-    int width = 8;
+    int display;
 
     if (argc == 1) {
-	width = strtoul(argv[0], NULL, 0);
+	display = strtoul(argv[0], NULL, 0);
+	if (display < 0 || display >= NumDisplays) {
+	    fputs("No such display\n", stderr);
+	    return;
+	}
+	Current = display;
+	Lcd = Display[display];
     }
+    printf("Display %d of %d\n", Current, NumDisplays);
+}
+
+static int ParseGeometry(const char *s, int *cols, int *rows)
+{
+    char *end;
+
+    *cols = strtoul(s, &end, 10);
+    if (*end != 'x')
+	return -1;
+    *rows = strtoul(end+1, &end, 10);
+    return *end ? -1 : 0;
+}
+
+static void Do_Init(int argc, const char *argv[])
+{
+    int width = 8, cols = Lcd->cols, rows = Lcd->rows;
+    int old_cols = cols, old_rows = rows;
+
+    for (; argc; argc--, argv++)
+	if (!strchr(argv[0], 'x'))
+	    width = strtoul(argv[0], NULL, 0);
+	else if (ParseGeometry(argv[0], &cols, &rows)) {
+	    fputs("Invalid geometry\n", stderr);
+	    return;
+	}
     if (width != 4 && width != 8)
 	return;
-    parlcd_init(width);
+    if (lcd_set_geometry(Lcd, cols, rows)) {
+	fputs("Unsupported geometry\n", stderr);
+	return;
+    }
+    if (LcdInit(Current, width)) {
+	fprintf(stderr, "A %dx%d LCD needs an e2 line in the wiring\n", cols,
+		rows);
+	/* The LCD wasn't touched, so it still shows the shadow */
+	lcd_set_geometry(Lcd, old_cols, old_rows);
+	memcpy(Lcd->data, Lcd->shadow, Lcd->cells);
+    }
 }
 
 static void Do_Hello(int argc, const char *argv[])
@@ -350,22 +531,22 @@ static void Do_Hello(int argc, const char *argv[])
     time_t t;
 
     t = times(&tms);
-    lcd_puts("Welcome to your\n"
-	     "Hitachi HD44780U\n"
-	     "driving a 20x4 LCD!\n");
+    lcd_printf(Lcd, "Welcome to your\n"
+	       "Hitachi HD44780U\n"
+	       "driving a %dx%d LCD!\n", Lcd->cols, Lcd->rows);
     t = times(&tms)-t;
-    lcd_printf("[%f seconds]", (double)t/clk_tck);
+    lcd_printf(Lcd, "[%f seconds]", (double)t/clk_tck);
 }
 
 static void Do_Print(int argc, const char *argv[])
 {
     while (argc--) {
-	lcd_puts(argv[0]);
+	lcd_puts(Lcd, argv[0]);
 	argv++;
 	if (argc)
-	    lcd_putc(' ');
+	    lcd_putc(Lcd, ' ');
     }
-    lcd_putc('\n');
+    lcd_putc(Lcd, '\n');
 }
 
 static void Do_Raw(int argc, const char *argv[])
@@ -374,27 +555,27 @@ static void Do_Raw(int argc, const char *argv[])
 
     while (argc--) {
 	for (i = 0; argv[0][i]; i++)
-	    lcd_write(argv[0][i]);
+	    lcd_write(Lcd, argv[0][i]);
 	argv++;
 	if (argc)
-	    lcd_write(' ');
+	    lcd_write(Lcd, ' ');
     }
 }
 
 static void Do_Clear(int argc, const char *argv[])
 {
-    lcd_clr();
+    lcd_clr(Lcd);
 }
 
 static void Do_Home(int argc, const char *argv[])
 {
-    lcd_home();
+    lcd_home(Lcd);
 }
 
 static void Do_Goto(int argc, const char *argv[])
 {
     if (argc == 1)
-	lcd_ddram(strtoul(argv[0], NULL, 0));
+	lcd_ddram(Lcd, strtoul(argv[0], NULL, 0));
 }
 
 static void Do_Font(int argc, const char *argv[])
@@ -412,7 +593,7 @@ static void Do_Font(int argc, const char *argv[])
 	    sleep(1);
 	    j = 0;
 	}
-	lcd_putc(i);
+	lcd_putc(Lcd, i);
     }
 }
 
@@ -429,7 +610,7 @@ static void Do_Move(int argc, const char *argv[])
 	    cnt = strtoul(argv[1], NULL, 0);
     }
     while (cnt--)
-	lcd_shift(LCD_MOVE_CURSOR, dir);
+	lcd_shift(Lcd, LCD_MOVE_CURSOR, dir);
 }
 
 static void Do_Shift(int argc, const char *argv[])
@@ -445,13 +626,15 @@ static void Do_Shift(int argc, const char *argv[])
 	    cnt = strtoul(argv[1], NULL, 0);
     }
     while (cnt--)
-	lcd_shift(LCD_SHIFT_DISP, dir);
+	lcd_shift(Lcd, LCD_SHIFT_DISP, dir);
 }
 
 static void Do_Cmd(int argc, const char *argv[])
 {
-    if (argc == 1)
-	lcd_write_cmd(strtoul(argv[0], NULL, 0));
+    if (argc == 1) {
+	lcd_write_cmd(Lcd, strtoul(argv[0], NULL, 0));
+	lcd_invalidate(Lcd);
+    }
 }
 
 static void Do_Backlight(int argc, const char *argv[])
@@ -466,7 +649,42 @@ static void Do_Backlight(int argc, const char *argv[])
 	else
 	    light = strtoul(argv[0], NULL, 0);
     }
-    lcd_backlight(light);
+    lcd_backlight(Lcd, light);
+}
+
+static void Do_Pacing(int argc, const char *argv[])
+{
+    if (argc == 1) {
+	if (!PartStrCaseCmp(argv[0], "busy"))
+	    lcd_set_pacing(Lcd, LCD_PACING_BUSY);
+	else if (!PartStrCaseCmp(argv[0], "delay"))
+	    lcd_set_pacing(Lcd, LCD_PACING_DELAY);
+	else
+	    return;
+    }
+    printf("Pacing: %s\n", Lcd->pacing == LCD_PACING_BUSY ? "busy" : "delay");
+}
+
+static void Do_Log(int argc, const char *argv[])
+{
+    while (argc--) {
+	lcd_log_write(Lcd, argv[0], strlen(argv[0]));
+	argv++;
+	if (argc)
+	    lcd_log_write(Lcd, " ", 1);
+    }
+    lcd_log_write(Lcd, "\n", 1);
+}
+
+static void Do_Drain(int argc, const char *argv[])
+{
+    printf("Drained %u characters\n", lcd_log_drain(Lcd));
+}
+
+static void Do_LogLevel(int argc, const char *argv[])
+{
+    if (argc == 1)
+	lcd_log_set_level(Lcd, strtoul(argv[0], NULL, 0));
 }
 
 static const char *Binary8(u8 val)
@@ -485,16 +703,35 @@ static void PrintLogicColor(int val, const char *name)
     printf("%s%s" NORMAL, val ? RED : GREEN, name);
 }
 
+static void Do_Screen(int argc, const char *argv[])
+{
+    if (Emulate)
+	simlcd_dump(&Simlcd[Current]);
+    else
+	fputs("Not using a software LCD\n", stderr);
+}
+
+static int NoParport(void)
+{
+    if (Emulate)
+	fputs("Not using a parallel port\n", stderr);
+    return Emulate;
+}
+
 static void Do_Data(int argc, const char *argv[])
 {
     u8 val;
 
+    if (NoParport())
+	return;
+
     if (argc == 0) {
-	val = parport_read_data();
+	val = parport_read_data(Bases[Current]);
 	printf("Data = 0x%02x = %sb\n", val, Binary8(val));
     } else {
 	val = strtoul(argv[0], NULL, 0);
-	parport_write_data(val);
+	parport_write_data(Bases[Current], val);
+	parlcd_sync(&Parlcd[Current]);
     }
 }
 
@@ -502,8 +739,11 @@ static void Do_Status(int argc, const char *argv[])
 {
     u8 val;
 
+    if (NoParport())
+	return;
+
     if (argc == 0) {
-	val = parport_read_status();
+	val = parport_read_status(Bases[Current]);
 	printf("Status = 0x%02x = %sb", val, Binary8(val));
 	PrintLogicColor(val & PARPORT_STATUS_BUSY, " *BUSY");
 	PrintLogicColor(val & PARPORT_STATUS_ACK, " *ACK");
@@ -513,7 +753,7 @@ static void Do_Status(int argc, const char *argv[])
 	putchar('\n');
     } else {
 	val = strtoul(argv[0], NULL, 0);
-	parport_write_status(val);
+	parport_write_status(Bases[Current], val);
     }
 }
 
@@ -521,8 +761,11 @@ static void Do_Control(int argc, const char *argv[])
 {
     u8 val;
 
+    if (NoParport())
+	return;
+
     if (argc == 0) {
-	val = parport_read_control();
+	val = parport_read_control(Bases[Current]);
 	printf("Control = 0x%02x = %sb", val, Binary8(val));
 	PrintLogicColor(!(val & PARPORT_CONTROL_SELECT), " *SELECT");
 	PrintLogicColor(val & PARPORT_CONTROL_INIT, " *INIT");
@@ -531,8 +774,541 @@ static void Do_Control(int argc, const char *argv[])
 	putchar('\n');
     } else {
 	val = strtoul(argv[0], NULL, 0);
-	parport_write_control(val);
+	parport_write_control(Bases[Current], val);
+	parlcd_sync(&Parlcd[Current]);
+    }
+}
+
+    /*
+     *  Benchmarks
+     *
+     *  Each workload returns the number of characters it sent to the LCD
+     */
+
+static const char *BenchWords[] = {
+    "eth0: link up", "sda: sda1 sda2", "usb 1-1: new device", "Freeing mem",
+    "VFS: Mounted root", "Adding swap", "NET: Registered", "EXT2-fs warning",
+};
+
+static unsigned int Bench_Hello(struct lcd_device *lcd)
+{
+    char hello[64];
+
+    sprintf(hello, "Welcome to your\n"
+		   "Hitachi HD44780U\n"
+		   "driving a %dx%d LCD!\n", lcd->cols, lcd->rows);
+    lcd_puts(lcd, hello);
+    return strlen(hello);
+}
+
+static unsigned int Bench_Redraw(struct lcd_device *lcd)
+{
+    unsigned int i;
+
+    for (i = 0; i < lcd->cells-1; i++)
+	lcd_putc(lcd, 'A'+i%26);
+    for (i = 0; i < 10; i++)
+	lcd_redraw(lcd);
+    return lcd->cells-1+10*lcd->cells;
+}
+
+static unsigned int Bench_Scroll(struct lcd_device *lcd)
+{
+    unsigned int i, n = 0;
+    char buf[32];
+
+    for (i = 0; i < 1000; i++) {
+	n += sprintf(buf, "%4u %s\n", i, BenchWords[i%arraysize(BenchWords)]);
+	lcd_puts(lcd, buf);
+    }
+    return n;
+}
+
+static unsigned int Bench_Font(struct lcd_device *lcd)
+{
+    unsigned int i;
+
+    for (i = 0; i < 256; i++)
+	lcd_putc(lcd, i);
+    return 256;
+}
+
+static unsigned int Bench_Console(struct lcd_device *lcd)
+{
+    unsigned int i, x, y, seed = 1;
+
+    /* Like lcdcon_putc(): move there, write, move back to the cursor */
+    for (i = 0; i < 500; i++) {
+	x = rand_r(&seed)%lcd->cols;
+	y = rand_r(&seed)%lcd->rows;
+	lcd_goto(lcd, x, y);
+	lcd_write(lcd, 'a'+i%26);
+	lcd_goto(lcd, 0, lcd->rows-1);
+    }
+    return 500;
+}
+
+static unsigned int Bench_Cgram(struct lcd_device *lcd)
+{
+    unsigned int i, j;
+
+    /* Every controller needs the glyphs */
+    lcd_select_all(lcd);
+    for (i = 0; i < 10; i++) {
+	lcd_cgram(lcd, 0);
+	for (j = 0; j < 64; j++)
+	    lcd_write(lcd, j & 8 ? 0x15 : 0x0a);
+	lcd_ddram(lcd, 0);
+    }
+    lcd_select(lcd, 0);
+    return 640;
+}
+
+    /*
+     *  A dashboard with a label and a 4-digit value per line, once sent
+     *  directly, once as a compiled sequence with patched values
+     */
+
+#define FRAMES		100
+
+static const char *FrameLabels[4] = {
+    "CPU load:", "Temperature:", "Fan speed:", "Disk usage:"
+};
+
+static void FrameLine(u8 *line, int cols, unsigned int y, unsigned int val)
+{
+    char buf[5];
+    int len = strlen(FrameLabels[y]);
+
+    memset(line, ' ', cols);
+    memcpy(line, FrameLabels[y], len < cols-4 ? len : cols-4);
+    sprintf(buf, "%4u", val%10000);
+    memcpy(line+cols-4, buf, 4);
+}
+
+static unsigned int Bench_Frame(struct lcd_device *lcd)
+{
+    int rows = lcd->rows, cols = lcd->cols;
+    unsigned int i, y;
+    u8 line[LCD_DDRAM_CELLS];
+
+    if (cols < 4)
+	return 0;
+    for (i = 0; i < FRAMES; i++)
+	for (y = 0; y < rows; y++) {
+	    FrameLine(line, cols, y, i*(y+1));
+	    lcd_goto(lcd, 0, y);
+	    lcd_write_vec(lcd, line, cols);
+	}
+    return FRAMES*rows*cols;
+}
+
+static unsigned int Bench_Template(struct lcd_device *lcd)
+{
+    int rows = lcd->rows, cols = lcd->cols;
+    struct lcd_seq *seq;
+    unsigned int i, y, j;
+    u8 line[LCD_DDRAM_CELLS];
+
+    if (cols < 4)
+	return 0;
+    if (!(seq = malloc(sizeof(*seq))) || lcd_seq_begin(lcd, seq)) {
+	free(seq);
+	return Bench_Frame(lcd);
+    }
+    for (y = 0; y < rows; y++) {
+	FrameLine(line, cols, y, 0);
+	lcd_goto(lcd, 0, y);
+	lcd_write_vec(lcd, line, cols);
+    }
+    if (lcd_seq_end(lcd, seq)) {
+	free(seq);
+	return Bench_Frame(lcd);
+    }
+    for (i = 0; i < FRAMES; i++) {
+	for (y = 0; y < rows; y++) {
+	    FrameLine(line, cols, y, i*(y+1));
+	    for (j = cols-4; j < cols; j++)
+		lcd_seq_patch(seq, y*cols+j, line[j]);
+	}
+	lcd_seq_run(lcd, seq);
+    }
+    free(seq);
+    return FRAMES*rows*cols;
+}
+
+    /*
+     *  The same dashboard on the rows of every controller, through the text
+     *  layer, which broadcasts the updates
+     */
+
+static unsigned int Bench_Mirror(struct lcd_device *lcd)
+{
+    int rows = lcd->rows, cols = lcd->cols;
+    unsigned int i, y, ly;
+
+    if (cols < 4)
+	return 0;
+    for (i = 0; i < FRAMES; i++) {
+	for (y = 0; y < rows; y++) {
+	    ly = y % lcd->chip_rows;
+	    FrameLine((u8 *)&lcd->data[y*cols], cols, ly, i*(ly+1));
+	}
+	lcd_flush(lcd);
     }
+    return FRAMES*rows*cols;
+}
+
+    /*
+     *  Console output as lcdcon sees it: a directory listing scrolling
+     *  through an 80x25 virtual screen, shown in a window of the LCD's size
+     *  that follows the cursor. Every line takes the console operations the
+     *  VT layer uses (hide the cursor, putcs, scroll at the bottom, show the
+     *  cursor). Like lcdcon_flush(), the window is copied into the text layer
+     *  and flushed, either after every operation, after every line, or once
+     *  per 25 lines, as the deferred flush does for a burst.
+     */
+
+#define VT_COLS		80
+#define VT_ROWS		25
+#define VT_LINES	200
+
+struct Vt {
+    u8 data[VT_ROWS][VT_COLS];
+    int x, y;				/* Cursor */
+    int view_x, view_y;
+    int cursor;				/* Cursor shown */
+};
+
+static void VtFlush(struct lcd_device *lcd, const struct Vt *vt)
+{
+    int y;
+
+    for (y = 0; y < lcd->rows; y++)
+	memcpy(&lcd->data[y*lcd->cols], &vt->data[vt->view_y+y][vt->view_x],
+	       lcd->cols);
+    lcd->col = vt->x-vt->view_x;
+    lcd->row = vt->y-vt->view_y;
+    lcd_flush(lcd);
+    if (vt->cursor)
+	lcd_ctrl(lcd, LCD_DISP_ON, LCD_CURSOR_ON, LCD_BLINK_ON);
+    else
+	lcd_ctrl(lcd, LCD_DISP_ON, LCD_CURSOR_OFF, LCD_BLINK_OFF);
+}
+
+static void VtFollow(struct lcd_device *lcd, struct Vt *vt)
+{
+    if (vt->x < vt->view_x)
+	vt->view_x = vt->x;
+    else if (vt->x >= vt->view_x+lcd->cols)
+	vt->view_x = vt->x-lcd->cols+1;
+    if (vt->y < vt->view_y)
+	vt->view_y = vt->y;
+    else if (vt->y >= vt->view_y+lcd->rows)
+	vt->view_y = vt->y-lcd->rows+1;
+}
+
+static unsigned int Bench_Vt(struct lcd_device *lcd, unsigned int burst)
+{
+    struct Vt vt;
+    char line[VT_COLS+1];
+    unsigned int i, n = 0;
+    int len;
+
+    if (lcd->cols > VT_COLS || lcd->rows > VT_ROWS)
+	return 0;
+    memset(&vt, 0, sizeof(vt));
+    memset(vt.data, ' ', sizeof(vt.data));
+    vt.cursor = 1;
+    VtFlush(lcd, &vt);
+    for (i = 0; i < VT_LINES; i++) {
+	len = sprintf(line, "%5u file%03u.c -rw-r--r-- 1 geert users",
+		      i*37, i);
+	vt.cursor = 0;
+	if (!burst)
+	    VtFlush(lcd, &vt);
+	memcpy(&vt.data[vt.y][0], line, len);
+	vt.x = len;
+	if (!burst)
+	    VtFlush(lcd, &vt);
+	vt.x = 0;
+	if (vt.y == VT_ROWS-1) {
+	    memmove(vt.data[0], vt.data[1], (VT_ROWS-1)*VT_COLS);
+	    memset(vt.data[VT_ROWS-1], ' ', VT_COLS);
+	    if (!burst)
+		VtFlush(lcd, &vt);
+	} else
+	    vt.y++;
+	vt.cursor = 1;
+	VtFollow(lcd, &vt);
+	if (!burst || (i+1) % burst == 0)
+	    VtFlush(lcd, &vt);
+	n += len;
+    }
+    VtFlush(lcd, &vt);
+    return n;
+}
+
+static unsigned int Bench_VtOp(struct lcd_device *lcd)
+{
+    return Bench_Vt(lcd, 0);
+}
+
+static unsigned int Bench_VtLine(struct lcd_device *lcd)
+{
+    return Bench_Vt(lcd, 1);
+}
+
+static unsigned int Bench_VtBurst(struct lcd_device *lcd)
+{
+    return Bench_Vt(lcd, VT_ROWS);
+}
+
+static const struct Workload {
+    const char *name;
+    unsigned int (*func)(struct lcd_device *lcd);
+} Workloads[] = {
+    { "hello", Bench_Hello },
+    { "redraw", Bench_Redraw },
+    { "scroll", Bench_Scroll },
+    { "font", Bench_Font },
+    { "console", Bench_Console },
+    { "cgram", Bench_Cgram },
+    { "frame", Bench_Frame },
+    { "template", Bench_Template },
+    { "mirror", Bench_Mirror },
+    { "vt-op", Bench_VtOp },
+    { "vt-line", Bench_VtLine },
+    { "vt-burst", Bench_VtBurst },
+};
+
+    /*
+     *  CPU time of the calling thread, so it's still meaningful when several
+     *  displays are benchmarked at once
+     */
+
+static unsigned long long CpuTime(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec*1000000000ULL+ts.tv_nsec;
+}
+
+static void RunWorkload(struct lcd_device *lcd, const struct Workload *w,
+			const char *tag)
+{
+    struct lcd_stats s0, s1;
+    unsigned long long t, cpu;
+    unsigned int n;
+
+    lcd_clr(lcd);
+    lcd_sync(lcd);
+    s0 = lcd->stats;
+    t = lcd_clock_ns();
+    cpu = CpuTime();
+    n = w->func(lcd);
+    lcd_sync(lcd);
+    cpu = CpuTime()-cpu;
+    t = lcd_clock_ns()-t;
+    s1 = lcd->stats;
+    printf("bench %sname=%s chars=%u us=%llu us_per_char=%.2f writes=%lu "
+	   "reads=%lu ios=%lu delay_us=%llu cpu_ns_per_char=%llu\n", tag,
+	   w->name, n, t/1000, t/1000.0/n, s1.write-s0.write,
+	   s1.read-s0.read, s1.io-s0.io, (s1.delay_ns-s0.delay_ns)/1000,
+	   cpu/n);
+}
+
+static void RunBench(struct lcd_device *lcd, int argc, const char **argv,
+		     const char *tag)
+{
+    u_int i;
+    int j;
+
+    for (i = 0; i < arraysize(Workloads); i++) {
+	for (j = 0; j < argc; j++)
+	    if (!PartStrCaseCmp(argv[j], Workloads[i].name))
+		break;
+	if (!argc || j < argc)
+	    RunWorkload(lcd, &Workloads[i], tag);
+    }
+}
+
+static void Do_Bench(int argc, const char **argv)
+{
+    RunBench(Lcd, argc, argv, "");
+}
+
+    /*
+     *  Run the benchmarks on all displays at once, one thread per display.
+     *  The displays share nothing, so the wall time should be that of the
+     *  slowest display, not the sum.
+     */
+
+struct BenchThread {
+    pthread_t thread;
+    int display;
+    int argc;
+    const char **argv;
+};
+
+static void *BenchThreadFunc(void *data)
+{
+    struct BenchThread *bt = data;
+    char tag[32];
+
+    sprintf(tag, "display=%d ", bt->display);
+    RunBench(Display[bt->display], bt->argc, bt->argv, tag);
+    return NULL;
+}
+
+static void Do_Threads(int argc, const char **argv)
+{
+    struct BenchThread threads[MAX_DISPLAYS];
+    struct timespec t0, t1;
+    int i, error;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = 0; i < NumDisplays; i++) {
+	threads[i].display = i;
+	threads[i].argc = argc;
+	threads[i].argv = argv;
+	if ((error = pthread_create(&threads[i].thread, NULL,
+				    BenchThreadFunc, &threads[i])))
+	    Die("pthread_create: %s\n", strerror(error));
+    }
+    for (i = 0; i < NumDisplays; i++)
+	pthread_join(threads[i].thread, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    printf("threads displays=%d wall_us=%llu\n", NumDisplays,
+	   ((t1.tv_sec-t0.tv_sec)*1000000000ULL+t1.tv_nsec-t0.tv_nsec)/1000);
+}
+
+    /*
+     *  Draw dashboard frames on all displays from a single event loop. The
+     *  queues are refilled whenever the scheduler returns, so every display
+     *  always has work, and the total time should be that of one display,
+     *  as long as the CPU keeps up.
+     */
+
+static void Do_Sched(int argc, const char **argv)
+{
+    static struct lcd_sched sched;
+    unsigned int frames = argc ? strtoul(argv[0], NULL, 0) : FRAMES;
+    unsigned int line_no[MAX_DISPLAYS], total = 0;
+    const struct lcd_sched_stats *st;
+    struct lcd_device *lcd;
+    unsigned long long t, cpu, busy;
+    u8 line[LCD_DDRAM_CELLS];
+    int i, y;
+    long left;
+
+    if (lcd_sched_init(&sched)) {
+	perror("lcd_sched_init");
+	return;
+    }
+    for (i = 0; i < NumDisplays; i++) {
+	lcd_clr(Display[i]);
+	lcd_sync(Display[i]);
+	lcd_sched_add(&sched, Display[i]);
+	line_no[i] = 0;
+    }
+    t = lcd_clock_ns();
+    cpu = CpuTime();
+    do {
+	for (i = 0; i < NumDisplays; i++) {
+	    lcd = Display[i];
+	    if (lcd->cols < 4)
+		continue;
+	    while (line_no[i] < frames*lcd->rows) {
+		y = line_no[i] % lcd->rows;
+		FrameLine(line, lcd->cols, y, line_no[i]/lcd->rows*(y+1));
+		if (lcd_sched_text(&sched, i, 0, y, line, lcd->cols, 0))
+		    break;
+		line_no[i]++;
+	    }
+	}
+	if ((left = lcd_sched_run(&sched)) > 0)
+	    lcd_sched_wait(&sched, left);
+    } while (left >= 0);
+    for (i = 0; i < NumDisplays; i++)
+	lcd_sync(Display[i]);
+    cpu = CpuTime()-cpu;
+    t = lcd_clock_ns()-t;
+    for (i = 0; i < NumDisplays; i++) {
+	st = &sched.queue[i].stats;
+	busy = st->busy_ns/1000;
+	printf("sched display=%d ops=%lu max_depth=%u busy_us=%llu "
+	       "ops_per_s=%llu late_us=%lu\n", i, st->issued, st->max_depth,
+	       busy, busy ? st->issued*1000000ULL/busy : 0, st->late_us);
+	total += st->issued;
+    }
+    printf("sched displays=%d frames=%u ops=%u us=%llu ops_per_s=%llu "
+	   "wakeups=%lu cpu_ns_per_op=%llu\n", NumDisplays, frames, total,
+	   t/1000, t ? total*1000000000ULL/t : 0, sched.wakeups,
+	   total ? cpu/total : 0);
+    lcd_sched_cleanup(&sched);
+}
+
+    /*
+     *  Self-checks on a software LCD of their own, so they don't depend on
+     *  the current display's geometry or contents
+     */
+
+static struct simlcd CheckSim;
+
+    /*
+     *  Only the controller showing the text cursor's row may show the
+     *  hardware cursor, and its address counter must be at the cursor's cell
+     */
+
+static int CheckCursor(struct simlcd *sim)
+{
+    struct lcd_device *lcd = &sim->lcd;
+    int chip = lcd->row/lcd->chip_rows, i;
+
+    for (i = 0; i < lcd->nchips; i++)
+	if (!sim->chip[i].cursor != (i != chip))
+	    return 0;
+    return sim->chip[chip].ac == lcd_cell_addr(lcd, lcd->col, lcd->row);
+}
+
+static int CheckStep(struct simlcd *sim, const char *name, const char *text)
+{
+    int ok;
+
+    if (text)
+	lcd_puts(&sim->lcd, text);
+    else
+	lcd_clr(&sim->lcd);
+    ok = CheckCursor(sim);
+    printf("check name=%s %s\n", name, ok ? "ok" : "FAILED");
+    return ok;
+}
+
+static void Do_Check(int argc, const char **argv)
+{
+    struct simlcd *sim = &CheckSim;
+
+    if (!Emulate) {
+	fputs("Not using a software LCD\n", stderr);
+	return;
+    }
+
+    /* A 40x4 display has two controllers, they must hand over the cursor */
+    memset(sim, 0, sizeof(*sim));
+    lcd_set_geometry(&sim->lcd, 40, 4);
+    simlcd_init(sim, 8);
+    CheckStep(sim, "cursor-init", "");
+    CheckStep(sim, "cursor-chip0", "row 0\nrow 1");
+    CheckStep(sim, "cursor-to-chip1", "\nrow 2");
+    CheckStep(sim, "cursor-on-chip1", "\nrow 3");
+    CheckStep(sim, "cursor-scroll", "\nscrolled");
+    CheckStep(sim, "cursor-clear", NULL);
+    CheckStep(sim, "cursor-wrap",
+	      "0123456789012345678901234567890123456789"
+	      "0123456789012345678901234567890123456789"
+	      "wrapped");
 }
 
 static const struct Command Commands[] = {
@@ -542,6 +1318,7 @@ static const struct Command Commands[] = {
     { "quit", Do_Quit },
     { "exit", Do_Quit },
     { "x", Do_Quit },
+    { "display", Do_Display },
     /* LCD Commands */
     { "init", Do_Init },
     { "hello", Do_Hello },
@@ -556,6 +1333,15 @@ static const struct Command Commands[] = {
     { "shift", Do_Shift },
     { "cmd", Do_Cmd },
     { "backlight", Do_Backlight },
+    { "pacing", Do_Pacing },
+    { "screen", Do_Screen },
+    { "bench", Do_Bench },
+    { "threads", Do_Threads },
+    { "sched", Do_Sched },
+    { "check", Do_Check },
+    { "log", Do_Log },
+    { "drain", Do_Drain },
+    { "loglevel", Do_LogLevel },
     /* Parallel Port Commands */
     { "data", Do_Data },
     { "status", Do_Status },
@@ -601,10 +1387,18 @@ static void Interpreter(void)
 
 static void Do_Dump(void)
 {
+    char buf[4096];
+    ssize_t n;
     int c;
 
-    while ((c = getchar()) != EOF)
-	lcd_putc(c);
+    if (Async)
+	while ((n = read(0, buf, sizeof(buf))) > 0) {
+	    lcd_log_write(Lcd, buf, n);
+	    lcd_log_drain(Lcd);
+	}
+    else
+	while ((c = getchar()) != EOF)
+	    lcd_putc(Lcd, c);
 }
 
 
@@ -617,6 +1411,8 @@ static void Do_Dump(void)
 
 int main(int argc, char **argv)
 {
+    int i;
+
     ProgramName = argv[0];
 
     while (--argc > 0) {
@@ -627,22 +1423,95 @@ int main(int argc, char **argv)
 	    Verbose = 1;
 	else if (!strcmp(argv[0], "-d") || !strcmp(argv[0], "--dump"))
 	    Dump = 1;
+	else if (!strcmp(argv[0], "-b") || !strcmp(argv[0], "--busy"))
+	    Busy = 1;
+	else if (!strcmp(argv[0], "-B") || !strcmp(argv[0], "--base")) {
+	    if (--argc == 0)
+		Usage();
+	    if (NumBases == MAX_DISPLAYS)
+		Die("Too many displays\n");
+	    Bases[NumBases++] = strtoul(*++argv, NULL, 0);
+	} else if (!strcmp(argv[0], "-n") || !strcmp(argv[0], "--displays")) {
+	    if (--argc == 0)
+		Usage();
+	    NumDisplays = strtoul(*++argv, NULL, 0);
+	    if (NumDisplays < 1 || NumDisplays > MAX_DISPLAYS)
+		Die("Number of displays must be 1-%d\n", MAX_DISPLAYS);
+	}
+	else if (!strcmp(argv[0], "-e") || !strcmp(argv[0], "--emulate"))
+	    Emulate = 1;
+	else if (!strcmp(argv[0], "-g") || !strcmp(argv[0], "--geometry")) {
+	    if (--argc == 0)
+		Usage();
+	    if (ParseGeometry(*++argv, &Cols, &Rows))
+		Usage();
+	}
+	else if (!strcmp(argv[0], "-V") || !strcmp(argv[0], "--virtual")) {
+	    lcd_set_clock(&lcd_clock_virtual);
+#ifndef PARPORT_DUMMY
+	    /* A real LCD can't be made to run in virtual time */
+	    Emulate = 1;
+#endif
+	}
+	else if (!strcmp(argv[0], "-t") || !strcmp(argv[0], "--tsc")) {
+	    if (--argc == 0)
+		Usage();
+	    TscFile = *++argv;
+	} else if (!strcmp(argv[0], "-p") || !strcmp(argv[0], "--pins")) {
+	    if (--argc == 0)
+		Usage();
+	    SetPins(*++argv);
+	} else if (!strcmp(argv[0], "--pin-file")) {
+	    if (--argc == 0)
+		Usage();
+	    ReadPinFile(*++argv);
+	} else if (!strcmp(argv[0], "-s") || !strcmp(argv[0], "--spin")) {
+	    if (--argc == 0)
+		Usage();
+	    lcd_set_spin_threshold(strtoul(*++argv, NULL, 0));
+	} else if (!strcmp(argv[0], "-a") || !strcmp(argv[0], "--async")) {
+	    Async = 1;
+	    Dump = 1;
+	}
 	else
 	    Usage();
     }
 
+#ifdef LCD_STATIC_PARLCD
+    if (Emulate)
+	Die("This build only supports the parallel port\n");
+#endif
+
     clk_tck = sysconf(_SC_CLK_TCK);
 
-    enable_isa_io();
+    if (TscFile && lcd_use_tsc(TscFile))
+	fputs("No invariant TSC, using CLOCK_MONOTONIC_RAW\n", stderr);
 
-    parlcd_init(8);
+    if (!Emulate) {
+	if (!NumBases)
+	    Bases[NumBases++] = PARPORT_BASE;
+	NumDisplays = NumBases;
+	enable_isa_io();
+    }
+
+    for (i = 0; i < NumDisplays; i++) {
+	Display[i] = Emulate ? &Simlcd[i].lcd : &Parlcd[i].lcd;
+	if (lcd_set_geometry(Display[i], Cols, Rows))
+	    Die("Unsupported geometry %dx%d\n", Cols, Rows);
+	if (LcdInit(i, 8))
+	    Die("A %dx%d LCD needs an e2 line in the wiring\n", Cols, Rows);
+	if (Busy)
+	    lcd_set_pacing(Display[i], LCD_PACING_BUSY);
+    }
+    Lcd = Display[Current];
     if (Dump)
 	Do_Dump();
     else
 	Interpreter();
-    parlcd_cleanup();
-
-    disable_isa_io();
+    for (i = 0; i < NumDisplays; i++)
+	LcdCleanup(i);
+    if (!Emulate)
+	disable_isa_io();
 
     return 0;
 }
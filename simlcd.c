@@ -0,0 +1,393 @@
+
+/*
+ *  Software model of the HD44780 LCD controller
+ *
+ *  This programs is subject to the terms and conditions of the GNU General
+ *  Public License
+ */
+
+
+#include <stdio.h>
+#include <string.h>
+
+typedef unsigned char u8;
+
+#include "hd44780.h"
+#include "simlcd.h"
+
+
+    /*
+     *  Software Model of a HD44780 LCD Controller
+     *
+     *  The model sits behind the low-level signal interface, so it sees
+     *  exactly the same E/RS/RW/data sequences as a real LCD would. It
+     *  implements DDRAM, CGRAM, the address counter, entry mode, display
+     *  shift, 4-bit nibble sequencing and the busy flag, and counts protocol
+     *  violations. Each controller of a module is modelled separately; they
+     *  share the bus and see only their own E line.
+     */
+
+#define SIMLCD_LINE_LEN		0x28
+#define SIMLCD_LINE2		0x40
+
+static int simlcd_busy(struct simlcd_chip *chip)
+{
+    return lcd_clock_ns() < chip->busy_until;
+}
+
+static void simlcd_set_busy(struct simlcd_chip *chip, unsigned int usecs)
+{
+    chip->busy_until = lcd_clock_ns()+usecs*1000ULL;
+}
+
+static int simlcd_step(struct simlcd_chip *chip, int ac, int inc)
+{
+    if (chip->cgram_sel)
+	return (ac + (inc ? 1 : -1)) & 63;
+    if (!chip->lines2)
+	return inc ? (ac == 0x4f ? 0 : ac+1) : (ac == 0 ? 0x4f : ac-1);
+    if (inc)
+	return ac == SIMLCD_LINE_LEN-1 ? SIMLCD_LINE2 :
+	       ac == SIMLCD_LINE2+SIMLCD_LINE_LEN-1 ? 0 : ac+1;
+    return ac == SIMLCD_LINE2 ? SIMLCD_LINE_LEN-1 :
+	   ac == 0 ? SIMLCD_LINE2+SIMLCD_LINE_LEN-1 : ac-1;
+}
+
+static void simlcd_shift_display(struct simlcd_chip *chip, int left)
+{
+    int len = chip->lines2 ? SIMLCD_LINE_LEN : 2*SIMLCD_LINE_LEN;
+
+    chip->shift = (chip->shift + (left ? 1 : len-1)) % len;
+}
+
+static void simlcd_exec_cmd(struct simlcd_chip *chip, u8 val)
+{
+    unsigned int usecs = SIMLCD_EXEC_US;
+
+    if (val & LCD_CMD_DDRAM) {
+	chip->ac = val & LCD_DDRAM_MASK;
+	chip->cgram_sel = 0;
+    } else if (val & LCD_CMD_CGRAM) {
+	chip->ac = val & LCD_CGRAM_MASK;
+	chip->cgram_sel = 1;
+    } else if (val & LCD_CMD_FUNC) {
+	chip->width = val & LCD_DATALEN_8 ? 8 : 4;
+	chip->lines2 = val & LCD_LINES_2 ? 1 : 0;
+	chip->nibble = 0;
+    } else if (val & LCD_CMD_SHIFT) {
+	if (val & LCD_SHIFT_DISP)
+	    simlcd_shift_display(chip, !(val & LCD_SHIFT_RIGHT));
+	else
+	    chip->ac = simlcd_step(chip, chip->ac, val & LCD_SHIFT_RIGHT);
+    } else if (val & LCD_CMD_CTRL) {
+	chip->disp = val & LCD_DISP_ON;
+	chip->cursor = val & LCD_CURSOR_ON;
+	chip->blink = val & LCD_BLINK_ON;
+    } else if (val & LCD_CMD_MODE) {
+	chip->inc = val & LCD_INC;
+	chip->shift_on = val & LCD_SHIFT_ON;
+    } else if (val & LCD_CMD_HOME) {
+	chip->ac = 0;
+	chip->cgram_sel = 0;
+	chip->shift = 0;
+	usecs = SIMLCD_EXEC_CLR_US;
+    } else if (val & LCD_CMD_CLR) {
+	memset(chip->ddram, ' ', sizeof(chip->ddram));
+	chip->ac = 0;
+	chip->cgram_sel = 0;
+	chip->shift = 0;
+	chip->inc = 1;
+	usecs = SIMLCD_EXEC_CLR_US;
+    }
+    simlcd_set_busy(chip, usecs);
+}
+
+static void simlcd_exec_data(struct simlcd_chip *chip, u8 val)
+{
+    if (chip->cgram_sel)
+	chip->cgram[chip->ac] = val;
+    else {
+	chip->ddram[chip->ac] = val;
+	if (chip->shift_on)
+	    simlcd_shift_display(chip, chip->inc);
+    }
+    chip->ac = simlcd_step(chip, chip->ac, chip->inc);
+    simlcd_set_busy(chip, SIMLCD_EXEC_US+SIMLCD_EXEC_ADD_US);
+}
+
+static void simlcd_exec_read(struct simlcd_chip *chip)
+{
+    chip->ac = simlcd_step(chip, chip->ac, chip->inc);
+    simlcd_set_busy(chip, SIMLCD_EXEC_US+SIMLCD_EXEC_ADD_US);
+}
+
+    /*
+     *  Accept a complete byte written by the host
+     */
+
+static void simlcd_write(struct simlcd *sim, struct simlcd_chip *chip, u8 val)
+{
+    if (simlcd_busy(chip)) {
+	/* The real thing ignores it, or worse */
+	sim->violations[SIMLCD_VIOL_BUSY]++;
+	return;
+    }
+    if (sim->rs)
+	simlcd_exec_data(chip, val);
+    else
+	simlcd_exec_cmd(chip, val);
+}
+
+    /*
+     *  Provide the byte to be read by the host
+     */
+
+static u8 simlcd_read(struct simlcd *sim, struct simlcd_chip *chip)
+{
+    if (!sim->rs)
+	return (simlcd_busy(chip) ? LCD_BUSY : 0) | chip->ac;
+    if (simlcd_busy(chip))
+	sim->violations[SIMLCD_VIOL_BUSY]++;
+    return chip->cgram_sel ? chip->cgram[chip->ac] : chip->ddram[chip->ac];
+}
+
+    /*
+     *  Handle an edge on the E line of one controller
+     */
+
+static void simlcd_edge(struct simlcd *sim, struct simlcd_chip *chip, int e)
+{
+    if (e) {
+	/* Rising edge: drive the bus when reading */
+	chip->e_rise = lcd_clock_ns();
+	if (sim->rw) {
+	    if (chip->width == 8 || !chip->nibble)
+		chip->out = simlcd_read(sim, chip);
+	    else
+		chip->out <<= 4;
+	}
+	return;
+    }
+
+    /* Falling edge: latch the bus when writing */
+    if (lcd_clock_ns()-chip->e_rise < SIMLCD_PW_EH_NS)
+	sim->violations[SIMLCD_VIOL_PULSE]++;
+    if (chip->width == 4) {
+	chip->nibble ^= 1;
+	if (sim->rw) {
+	    if (!chip->nibble && sim->rs)
+		simlcd_exec_read(chip);
+	} else if (chip->nibble)
+	    chip->hi = sim->data & 0xf0;
+	else
+	    simlcd_write(sim, chip, chip->hi | (sim->data >> 4));
+    } else if (sim->rw) {
+	if (sim->rs)
+	    simlcd_exec_read(chip);
+    } else
+	simlcd_write(sim, chip, sim->data);
+}
+
+
+    /*
+     *  Low-Level LCD Access
+     *
+     *  Every signal access counts as one port access. For compiled sequences,
+     *  each signal is a port. Raising E raises the E lines of the controllers
+     *  selected by the device's e_mask.
+     */
+
+#define SIMLCD_PORT_RS_RW	0	/* Bit 0 is RS, bit 1 is RW */
+#define SIMLCD_PORT_E		1	/* One bit per controller */
+#define SIMLCD_PORT_BL		2
+#define SIMLCD_PORT_DATA	3
+
+static void simlcd_set_rs_rw(struct lcd_device *lcd, int rs, int rw)
+{
+    struct simlcd *sim = lcd->priv;
+
+    if (lcd->seq_recording) {
+	lcd_seq_out(lcd, SIMLCD_PORT_RS_RW, (rs ? 1 : 0) | (rw ? 2 : 0), 0);
+	return;
+    }
+    lcd->stats.io++;
+    if (sim->e && (rs != sim->rs || rw != sim->rw))
+	sim->violations[SIMLCD_VIOL_SETUP]++;
+    sim->rs = rs;
+    sim->rw = rw;
+}
+
+static void simlcd_set_lines_e(struct lcd_device *lcd, unsigned int e)
+{
+    struct simlcd *sim = lcd->priv;
+    unsigned int changed = e ^ sim->e;
+    int i;
+
+    lcd->stats.io++;
+    sim->e = e;
+    for (i = 0; i < SIMLCD_CHIPS; i++)
+	if (changed & (1 << i))
+	    simlcd_edge(sim, &sim->chip[i], e & (1 << i));
+}
+
+static void simlcd_set_e(struct lcd_device *lcd, int e)
+{
+    unsigned int lines = e ? lcd->e_mask : 0;
+
+    if (lcd->seq_recording) {
+	lcd_seq_out(lcd, SIMLCD_PORT_E, lines, 0);
+	return;
+    }
+    simlcd_set_lines_e(lcd, lines);
+}
+
+static void simlcd_set_bl(struct lcd_device *lcd, int bl)
+{
+    struct simlcd *sim = lcd->priv;
+
+    if (lcd->seq_recording) {
+	lcd_seq_out(lcd, SIMLCD_PORT_BL, bl, 0);
+	return;
+    }
+    lcd->stats.io++;
+    sim->bl = bl;
+}
+
+static void simlcd_set_data(struct lcd_device *lcd, u8 val)
+{
+    struct simlcd *sim = lcd->priv;
+
+    if (sim->bus_width == 4)
+	val |= 0x0f;		/* Unconnected lines */
+    if (lcd->seq_recording) {
+	lcd_seq_out(lcd, SIMLCD_PORT_DATA, val, 1);
+	return;
+    }
+    lcd->stats.io++;
+    sim->data = val;
+}
+
+static u8 simlcd_get_data(struct lcd_device *lcd)
+{
+    struct simlcd *sim = lcd->priv;
+    int i;
+
+    lcd->stats.io++;
+    if (sim->rw)
+	for (i = 0; i < SIMLCD_CHIPS; i++)
+	    if (sim->e & (1 << i)) {
+		u8 out = sim->chip[i].out;
+		return sim->bus_width == 4 ? out | 0x0f : out;
+	    }
+    return sim->data;
+}
+
+
+static void simlcd_run_seq(struct lcd_device *lcd, const struct lcd_seq *seq)
+{
+    const struct lcd_step *step, *end = seq->step+seq->n;
+
+    for (step = seq->step; step < end; step++)
+	if (step->op == LCD_SEQ_DELAY)
+	    lcd_ndelay(lcd, step->arg);
+	else
+	    switch (step->arg) {
+		case SIMLCD_PORT_RS_RW:
+		    simlcd_set_rs_rw(lcd, step->val & 1, step->val & 2);
+		    break;
+
+		case SIMLCD_PORT_E:
+		    simlcd_set_lines_e(lcd, step->val);
+		    break;
+
+		case SIMLCD_PORT_BL:
+		    simlcd_set_bl(lcd, step->val);
+		    break;
+
+		case SIMLCD_PORT_DATA:
+		    simlcd_set_data(lcd, step->val);
+		    break;
+	    }
+}
+
+
+static const struct lcd_driver simlcd_driver = {
+    run_seq:	simlcd_run_seq,
+    set_rs_rw:	simlcd_set_rs_rw,
+    set_e:	simlcd_set_e,
+    set_bl:	simlcd_set_bl,
+    set_data:	simlcd_set_data,
+    get_data:	simlcd_get_data
+};
+
+
+    /*
+     *  Dump the Visible Screen
+     *
+     *  The glass has the geometry the driver was configured for, the rows of
+     *  each controller follow those of the previous one
+     */
+
+void simlcd_dump(struct simlcd *sim)
+{
+    int cols = sim->lcd.cols, rows = sim->lcd.rows;
+    const struct simlcd_chip *chip;
+    int x, y, ly, len, line, addr;
+    u8 c;
+
+    printf("+");
+    for (x = 0; x < cols; x++)
+	putchar('-');
+    printf("+%s\n", sim->bl ? "" : " (backlight off)");
+    for (y = 0; y < rows; y++) {
+	putchar('|');
+	chip = &sim->chip[y/sim->lcd.chip_rows];
+	ly = y % sim->lcd.chip_rows;
+	len = chip->lines2 ? SIMLCD_LINE_LEN : 2*SIMLCD_LINE_LEN;
+	line = chip->lines2 ? ly & 1 : 0;
+	for (x = 0; x < cols; x++) {
+	    addr = x + (chip->lines2 ? ly >> 1 : ly)*cols;
+	    addr = (addr + chip->shift) % len;
+	    c = chip->ddram[line*SIMLCD_LINE2+addr];
+	    putchar(!chip->disp ? ' ' : c >= 0x20 && c < 0x7f ? c : '.');
+	}
+	printf("|\n");
+    }
+    printf("+");
+    for (x = 0; x < cols; x++)
+	putchar('-');
+    printf("+\n");
+}
+
+
+    /*
+     *  Software LCD Control
+     */
+
+void simlcd_init(struct simlcd *sim, int width)
+{
+    int i;
+
+    if (!sim->chip[0].width) {
+	/* Power-on reset */
+	for (i = 0; i < SIMLCD_CHIPS; i++) {
+	    memset(sim->chip[i].ddram, ' ', sizeof(sim->chip[i].ddram));
+	    sim->chip[i].width = 8;
+	    sim->chip[i].inc = 1;
+	}
+	sim->bl = 1;
+    }
+    sim->bus_width = width;
+    lcd_register_driver(&sim->lcd, &simlcd_driver, sim);
+    lcd_init(&sim->lcd, width);
+}
+
+void simlcd_cleanup(struct simlcd *sim)
+{
+    lcd_cleanup(&sim->lcd);
+    lcd_unregister_driver(&sim->lcd, &simlcd_driver);
+    printf("Violations: %u while busy, %u short pulses, %u setup\n",
+	   sim->violations[SIMLCD_VIOL_BUSY],
+	   sim->violations[SIMLCD_VIOL_PULSE],
+	   sim->violations[SIMLCD_VIOL_SETUP]);
+}
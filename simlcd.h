@@ -0,0 +1,72 @@
+
+/*
+ *  Software model of the HD44780 LCD controller
+ *
+ *  This programs is subject to the terms and conditions of the GNU General
+ *  Public License
+ */
+
+
+    /*
+     *  Execution Times (HD44780U at 270 kHz)
+     */
+
+#define SIMLCD_EXEC_US		37
+#define SIMLCD_EXEC_CLR_US	1520
+#define SIMLCD_EXEC_ADD_US	4	/* Address counter update after data */
+#define SIMLCD_PW_EH_NS		450	/* Minimum enable pulse width */
+
+
+    /*
+     *  Protocol Violations
+     */
+
+#define SIMLCD_VIOL_BUSY	0	/* Instruction or data while busy */
+#define SIMLCD_VIOL_PULSE	1	/* Enable pulse too short */
+#define SIMLCD_VIOL_SETUP	2	/* RS/RW changed while enable is high */
+#define SIMLCD_VIOL_NUM		3
+
+
+    /*
+     *  Software LCD Instance, zero it before use
+     *
+     *  Modules with more than 80 characters have a second controller, which
+     *  shares all lines except E with the first one
+     */
+
+#define SIMLCD_CHIPS		2
+
+struct simlcd_chip {
+    unsigned long long e_rise;
+    u8 ddram[128];
+    u8 cgram[64];
+    int ac, cgram_sel;
+    int inc, shift_on;
+    int disp, cursor, blink;
+    int width, lines2;
+    int shift;
+    int nibble;
+    u8 hi, out;
+    unsigned long long busy_until;
+};
+
+struct simlcd {
+    struct lcd_device lcd;
+    int bus_width;
+    /* Interface */
+    int rs, rw, bl;
+    unsigned int e;		/* One bit per controller */
+    u8 data;
+    /* Controllers */
+    struct simlcd_chip chip[SIMLCD_CHIPS];
+    unsigned int violations[SIMLCD_VIOL_NUM];
+};
+
+
+    /*
+     *  Software LCD Control
+     */
+
+extern void simlcd_init(struct simlcd *sim, int width);
+extern void simlcd_cleanup(struct simlcd *sim);
+extern void simlcd_dump(struct simlcd *sim);